@@ -23,11 +23,14 @@ See http://acid.readthedocs.org/
 from __future__ import absolute_import
 from __future__ import with_statement
 
+import bisect
 import itertools
 import logging
 import operator
-import struct
+import random
+import sys
 import threading
+import time
 import warnings
 
 import acid
@@ -36,9 +39,12 @@ from acid import encoders
 from acid import errors
 from acid import iterators
 from acid import keylib
+from acid import structlib
 
-__all__ = ['Store', 'Collection', 'Index', 'open', 'abort', 'add_index']
+__all__ = ['Store', 'Collection', 'Index', 'open', 'abort', 'add_index',
+           'Equal', 'Prefix', 'Range']
 
+ITEMGETTER_0 = operator.itemgetter(0)
 ITEMGETTER_1 = operator.itemgetter(1)
 ATTRGETTER_KEY = operator.attrgetter('key')
 ATTRGETTER_DATA = operator.attrgetter('data')
@@ -65,6 +71,18 @@ def dispatch(lst, *args):
             lst.pop(i)
 
 
+class Dispatcher(list):
+    """List of event listeners that is invoked as `dispatcher(*args)` to
+    :py:func:`dispatch` the event. This is replaced by a C implementation that
+    passes the argument tuple through to listeners without copying it, and
+    returns immediately when no listeners are registered."""
+    __slots__ = ()
+
+    def __call__(self, *args):
+        if self:
+            dispatch(self, *args)
+
+
 def bisect_func_right(x, lo, hi, func):
     """Bisect `func(i)`, returning an index such that consecutive values are
     greater than `x`. If `x` is present, the returned index is past its last
@@ -85,6 +103,34 @@ def abort():
     raise errors.AbortError('')
 
 
+def sweep_get(strategy, txn, keys, max_steps=16):
+    """Yield `(key, data)` for each key in the sorted list `keys` that exists
+    in the collection accessed via `strategy`. Records are visited using a
+    single forward iterator, which is reseeked only when the next key lies
+    more than `max_steps` records beyond the current position."""
+    gen = None
+    res = None
+    for key in keys:
+        steps = 0
+        while gen is not None and res.key < key:
+            if steps == max_steps:
+                gen = None
+                break
+            res = next(gen, None)
+            if res is None:
+                return
+            steps += 1
+        if gen is None:
+            it = strategy.iter(txn)
+            it.set_lo(key)
+            gen = it.forward()
+            res = next(gen, None)
+            if res is None:
+                return
+        if res.key == key:
+            yield key, bytes(res.data)
+
+
 def open(url, trace_path=None, txn_context=None):
     """Instantiate an engine described by `url` and return a new
     :py:class:`Store` wrapping it. See :ref:`engines` for supported URL
@@ -125,7 +171,7 @@ def open(url, trace_path=None, txn_context=None):
         return Store(engine)
 
 
-def add_index(coll, name, func):
+def add_index(coll, name, func, cover=None, unique=False, where=None):
     """Associate an index with the collection. Index metadata will be
     created in the storage engine it it does not exist. Returns the `Index`
     instance describing the index. This method may only be invoked once for
@@ -168,12 +214,52 @@ def add_index(coll, name, func):
                 (('Charles',),  (3,)),
                 (('David',),    (1,))
             ]
+
+    `cover`:
+        Optional function accepting one argument, the record value, returning
+        a primitive value or tuple of primitive values to store in each of the
+        record's index entries. Queries needing only these values may use
+        :py:meth:`Index.items(covered=True) <Index.items>` to avoid fetching
+        records. Like `func`, it must have no side-effects.
+
+    `unique`:
+        If ``True``, writing a record producing an index tuple already
+        produced by another record raises
+        :py:class:`acid.errors.UniqueError`. The existing entry is found with
+        a single seek, avoiding the need for a constraint querying the index.
+        The check occurs before the record is written. Until
+        :py:meth:`Index.build` completes, each write also scans the records
+        it has yet to index. If existing records already share a tuple,
+        :py:meth:`Index.build` raises the error without recording progress;
+        once one of the records is changed or deleted, calling it again
+        resumes the build.
+
+    `where`:
+        Optional dict mapping record fields to a :py:class:`Condition`, or a
+        plain value to match by equality. Only records whose fields satisfy
+        every condition are indexed; the index function is never invoked for
+        others. Fields are read directly from the record's encoding where
+        the encoder allows: for :py:func:`acid.encoders.make_struct_encoder`
+        encoders, fields are struct field names and only the named fields are
+        decoded; for :py:attr:`acid.encoders.KEY`, fields are tuple positions.
+        Other encoders use their `get` function.
+
+        ::
+
+            # Index only open tickets.
+            acid.add_index(tickets, 'open_by_owner',
+                           lambda t: t['owner'], where={'status': u'open'})
+
+    An index created for a collection that already contains records is not
+    usable until :py:meth:`Index.build` has indexed them.
     """
     # assert name not in coll.indices TODO
     info_name = 'index:%s:%s' % (coll.info['name'], name)
-    info = coll.store.get_index_meta(info_name, coll.info['name'])
-    index = Index(coll, info, func)
+    empty = lambda: coll.findkey() is None
+    info = coll.store.get_index_meta(info_name, coll.info['name'], empty)
+    index = Index(coll, info, func, cover, unique, where)
     coll.store._objs[name] = index
+    coll.indices[name] = index
     return index
 
 
@@ -198,16 +284,115 @@ class Index(object):
         `max`:
             Maximum number of index records to return.
     """
+    #: Number of index entries whose records :py:meth:`items` fetches with
+    #: each sweep of the collection.
+    JOIN_CHUNK = 64
 
     def _index_keys(self, key, obj):
         """Generate a list of encoded keys representing index entries for `obj`
         existing under `key`."""
+        if self.where is not None and not self._selected(obj):
+            return None
         res = self.func(obj)
         if type(res) is list:
             return [keylib.packs([ik, key], self.prefix) for ik in res]
         elif res is not None:
             return [keylib.packs([res, key], self.prefix)]
 
+    def _field_reader(self, name):
+        """Return `(get, get_raw)` functions returning field `name` given a
+        record value or its key and encoding respectively, or ``None`` if it
+        is unset. `get_raw` is ``None`` if the record must be decoded."""
+        encoder = self.coll.encoder
+        struct_type = getattr(encoder, 'struct_type', None)
+        if struct_type is not None:
+            for field in struct_type.sorted_by_id:
+                if field.name == name:
+                    get_raw = lambda key, data: \
+                        struct_type.read_value(bytes(data), field)
+                    return (lambda obj: getattr(obj, name)), get_raw
+            raise errors.ConfigError('%r has no field %r' % (encoder, name))
+        if encoder is encoders.KEY:
+            get = lambda tup: tup[name] if name < len(tup) else None
+            return get, lambda key, data: get(keylib.unpack(data))
+        return (lambda obj: encoder.get(obj, name, None)), None
+
+    def _selected(self, obj):
+        """Return ``True`` if the record value `obj` satisfies :py:attr:`where`.
+        """
+        for (get, _), cond in self._readers:
+            value = get(obj)
+            if value is None or not cond.matches(keylib.packs(value)):
+                return False
+        return True
+
+    def _selected_raw(self, key, data):
+        """Like :py:meth:`_selected`, but given the record's key and encoding,
+        avoiding decoding the record where possible."""
+        for (get, get_raw), cond in self._readers:
+            if get_raw is None:
+                return self._selected(self.coll.encoder.unpack(key, data))
+            value = get_raw(key, data)
+            if value is None or not cond.matches(keylib.packs(value)):
+                return False
+        return True
+
+    def _entry_value(self, obj):
+        """Return the value of index entries for `obj`: the encoded output of
+        the cover function, or the empty string."""
+        if self.cover is None:
+            return ''
+        return keylib.packs(self.cover(obj))
+
+    def _check_unique(self, txn, pairs, unbuilt=True):
+        """Raise :py:class:`acid.errors.UniqueError` if any `(key, record)` in
+        `pairs` produces an index tuple already produced by another record,
+        either in the index or earlier in `pairs`. Entries sharing a tuple are
+        adjacent and prefixed by the encoded tuple, so each needs one seek.
+        If `unbuilt` is ``True``, records not yet indexed are also checked."""
+        info = self._get_info()
+        # Entries being cleared for a rebuild may be stale.
+        probe = not info.get('clearing')
+        stems = {}
+        for key, rec in pairs:
+            for entry in self._index_keys(key, rec) or ():
+                stem = entry[:-len(key.to_raw())]
+                if stems.setdefault(stem, key) != key:
+                    self._unique_error(stem)
+                if not probe:
+                    continue
+                for k, _ in txn.iter(stem, False):
+                    k = bytes(k)
+                    if not k.startswith(stem):
+                        break
+                    if k != entry:
+                        self._unique_error(stem)
+        if unbuilt and stems and not info.get('ready', True):
+            self._check_unbuilt(txn, info, stems)
+
+    def _check_unbuilt(self, txn, info, stems):
+        """Raise :py:class:`acid.errors.UniqueError` if a record
+        :py:meth:`build` has yet to index produces a tuple in `stems`, a
+        mapping of encoded tuple to the key of the record producing it."""
+        it = self.coll.strategy.iter(txn)
+        if info.get('build_key') and not info.get('clearing'):
+            it.set_lo(keylib.Key.from_raw(info['build_key']), closed=False)
+        unpack = self.coll.encoder.unpack
+        for r in it.forward():
+            if self.where is not None and \
+                    not self._selected_raw(r.key, r.data):
+                continue
+            size = len(r.key.to_raw())
+            for entry in self._index_keys(r.key, unpack(r.key, r.data)) or ():
+                stem = entry[:-size]
+                if stems.get(stem, r.key) != r.key:
+                    self._unique_error(stem)
+
+    def _unique_error(self, stem):
+        tup = keylib.unpacks(stem, self.prefix)[0]
+        raise errors.UniqueError('%r already contains %r' % (self, tup),
+                                 self.info['name'])
+
     def _coll_after_delete(self, key, rec):
         """Respond to after_delete() Collection event by removing any index
         entries for the deleted record."""
@@ -223,40 +408,285 @@ class Index(object):
         keys = self._index_keys(key, rec)
         if keys:
             txn = self.store._txn_context.get()
+            value = self._entry_value(rec)
             for k in keys:
-                txn.put(k, '')
+                txn.put(k, value)
 
     def _coll_after_replace(self, key, oldrec, newrec):
-        """Respond to after_replace() Collection event by updating the set of
-        index entries for the record."""
-        oldkeys = self._index_keys(key, oldrec)
-        newkeys = self._index_keys(key, newrec)
-        if oldkeys != newkeys:
+        """Respond to after_replace() Collection event by writing only the
+        index entries that were added or removed for the record."""
+        oldkeys = sorted(self._index_keys(key, oldrec) or ())
+        newkeys = sorted(self._index_keys(key, newrec) or ())
+        removed, added = keylib.sorted_diff(oldkeys, newkeys)
+        value = self._entry_value(newrec)
+        if value != self._entry_value(oldrec):
+            # Every entry's value changed.
+            added = newkeys
+        if removed or added:
             txn = self.store._txn_context.get()
-            for k in oldkeys:
+            for k in removed:
                 txn.delete(k)
-            for k in newkeys:
-                txn.put(k, '')
+            for k in added:
+                txn.put(k, value)
 
     def __repr__(self):
         klass = self.__class__.__name__
         return "<%s.%s %s>" % (__name__, klass, self.info['name'])
 
-    def __init__(self, coll, info, func):
+    def __init__(self, coll, info, func, cover=None, unique=False,
+                 where=None):
         self.coll = coll
         self.store = coll.store
         self.info = info
         #: The index function.
         self.func = func
+        #: The cover function, or ``None``.
+        self.cover = cover
+        #: If ``True``, index tuples may be produced by only one record.
+        self.unique = unique
+        if unique:
+            coll._unique_indices.append(self)
+        #: Mapping of field to :py:class:`Condition` records must satisfy to
+        #: be indexed, or ``None``.
+        self.where = None
+        if where:
+            self.where = dict((f, c if isinstance(c, Condition) else Equal(c))
+                              for f, c in where.iteritems())
+            self._readers = [(self._field_reader(f), c)
+                             for f, c in sorted(self.where.iteritems())]
         self.prefix = keylib.pack_int(info['idx'], self.store.prefix)
 
         events.after_delete(self._coll_after_delete, coll)
         events.after_create(self._coll_after_create, coll)
         events.after_replace(self._coll_after_replace, coll)
 
+    def _get_info(self):
+        return self.store.get_meta(KIND_INDEX, self.info['name'])
+
+    @property
+    def ready(self):
+        """``True`` if the index covers every record in the collection."""
+        # Indices created before resumable builds are always ready.
+        return self._get_info().get('ready', True)
+
+    def build(self, max_recs=1000):
+        """Perform one step of building the index from the collection's
+        existing records in the current write transaction, indexing at most
+        `max_recs` records. Progress is recorded in the index metadata, so a
+        build may be spread over many transactions, or resumed after a crash,
+        by repeatedly calling this method until it returns ``True``. Records
+        written during the build are indexed as usual:
+
+        ::
+
+            while not store.in_txn(index.build, write=True):
+                pass
+        """
+        info = self._get_info()
+        if info.get('ready', True):
+            return True
+        txn = self.store._txn_context.get()
+        if info.get('clearing'):
+            self._clear_step(txn, info, max_recs)
+            return False
+
+        it = self.coll.strategy.iter(txn)
+        if info.get('build_key'):
+            it.set_lo(keylib.Key.from_raw(info['build_key']), closed=False)
+        it.set_max(max_recs)
+        entries = []
+        pairs = []
+        found = 0
+        last = None
+        unpack = self.coll.encoder.unpack
+        for r in it.forward():
+            found += 1
+            last = r.key
+            if self.where is not None and \
+                    not self._selected_raw(r.key, r.data):
+                continue
+            obj = unpack(r.key, r.data)
+            value = self._entry_value(obj)
+            entries.extend((k, value) for k in self._index_keys(r.key, obj)
+                           or ())
+            if self.unique:
+                pairs.append((r.key, obj))
+
+        if pairs:
+            # Records after this step are checked when they are indexed.
+            self._check_unique(txn, pairs, unbuilt=False)
+        entries.sort()
+        for k, value in entries:
+            txn.put(k, value)
+        if found < max_recs:
+            info['ready'] = True
+            info['build_key'] = None
+        else:
+            info['build_key'] = last.to_raw()
+        self.store.set_meta(KIND_INDEX, info['name'], info)
+        return info['ready']
+
+    def _clear_step(self, txn, info, max_recs):
+        """Delete at most `max_recs` index entries, recording when none
+        remain."""
+        keys = []
+        for key, _ in txn.iter(self.prefix, False):
+            if len(keys) == max_recs or not key.startswith(self.prefix):
+                break
+            keys.append(bytes(key))
+        for key in keys:
+            txn.delete(key)
+        if len(keys) < max_recs:
+            info['clearing'] = False
+            self.store.set_meta(KIND_INDEX, info['name'], info)
+
+    def rebuild(self):
+        """Mark the index as requiring a rebuild, for example following a
+        change to the index function. Subsequent calls to :py:meth:`build`
+        delete the existing entries before indexing each record again, and
+        queries fail until the rebuild completes."""
+        info = self._get_info()
+        info.update(ready=False, clearing=True, build_key=None)
+        self.store.set_meta(KIND_INDEX, info['name'], info)
+
+    def analyze(self, buckets=64):
+        """Scan the index in the current transaction, collecting statistics
+        used by :py:meth:`estimate`, and store them in the index metadata.
+        The histogram retains between `buckets` and twice `buckets` entry
+        keys. Returns the statistics as for :py:meth:`stats`."""
+        txn = self.store._txn_context.get()
+        plen = len(self.prefix)
+        count = 0
+        depth = 1
+        bounds = []
+        distinct = []
+        prev = ()
+        raw = None
+        for key, _ in txn.iter(self.prefix, False):
+            if not key.startswith(self.prefix):
+                break
+            raw = bytes(key)[plen:]
+            if not (count % depth):
+                bounds.append(raw)
+                if len(bounds) > (2 * buckets):
+                    # Halve the histogram's resolution.
+                    bounds = bounds[::2]
+                    depth *= 2
+            count += 1
+
+            tup = keylib.unpacks(raw)[0]
+            pos = 0
+            while pos < min(len(tup), len(prev)) and tup[pos] == prev[pos]:
+                pos += 1
+            if pos < len(tup) or len(tup) != len(prev):
+                for i in xrange(pos, len(tup)):
+                    if i == len(distinct):
+                        distinct.append(0)
+                    distinct[i] += 1
+            prev = tup
+
+        if raw is not None and bounds[-1] != raw:
+            bounds.append(raw)
+        info = self._get_info()
+        info.update(stats_count=count, stats_depth=depth,
+                    stats_distinct=keylib.packs(tuple(distinct)),
+                    stats_bounds=keylib.packs(tuple(bounds)))
+        self.store.set_meta(KIND_INDEX, info['name'], info)
+        return self.stats()
+
+    def stats(self):
+        """Return the statistics last collected by :py:meth:`analyze`, or
+        ``None``. The result is a dict containing:
+
+            `count`:
+                Number of index entries.
+
+            `distinct`:
+                List whose `i`\ th element is the number of distinct index
+                tuple prefixes of length `i + 1`.
+
+            `depth`:
+                Number of entries between adjacent histogram bounds.
+
+            `bounds`:
+                Sorted list of raw entry keys, excluding the index prefix,
+                starting with the first entry, followed by every `depth`\ th
+                entry, and the last entry.
+        """
+        info = self._get_info()
+        if 'stats_count' not in info:
+            return None
+        return {'count': info['stats_count'],
+                'depth': info['stats_depth'],
+                'distinct': list(keylib.unpack(info['stats_distinct'])),
+                'bounds': list(keylib.unpack(info['stats_bounds']))}
+
+    def estimate(self, args=None, lo=None, hi=None, prefix=None):
+        """Return the estimated number of entries matching the parameters
+        accepted by :py:meth:`count`, without scanning the index, or ``None``
+        if :py:meth:`analyze` has never run. Equality on a prefix of the index
+        tuple is estimated using the number of distinct prefixes, unless the
+        histogram shows the prefix spans several buckets."""
+        stats = self.stats()
+        if stats is None:
+            return None
+        bounds = stats['bounds']
+        if not bounds:
+            return 0
+
+        exact = None
+        if args is None and prefix is not None:
+            args = prefix
+        if args is not None:
+            args = keylib.Key(args)
+            lo = args.to_raw()
+            pbound = args.prefix_bound()
+            hi = pbound and pbound.to_raw()
+            if len(args) <= len(stats['distinct']):
+                exact = self._density(stats, len(args))
+        else:
+            lo = None if lo is None else keylib.Key(lo).to_raw()
+            hi = None if hi is None else keylib.Key(hi).to_raw()
+
+        if (lo and lo > bounds[-1]) or (hi and hi <= bounds[0]) \
+                or (lo and hi and lo >= hi):
+            return 0
+        def position(i):
+            # Bounds are every `depth`th entry, followed by the last entry.
+            if i >= (len(bounds) - 1):
+                return stats['count'] - (len(bounds) - i)
+            return i * stats['depth']
+        start = bisect.bisect_left(bounds, lo) if lo else 0
+        end = bisect.bisect_left(bounds, hi) if hi else len(bounds)
+        spanned = position(end) - position(start)
+        if exact is not None and spanned <= stats['depth']:
+            return max(1, min(exact, stats['depth']))
+        if not spanned:
+            # Range falls between two bounds.
+            return max(1, stats['depth'] // 2)
+        return min(stats['count'], spanned)
+
+    def _density(self, stats, length):
+        """Return the average entries per distinct index tuple prefix of
+        `length`, excluding popular prefixes, i.e. those appearing as more
+        than one histogram bound, since any query for them spans several
+        buckets."""
+        depth = stats['depth']
+        seen = {}
+        for raw in stats['bounds']:
+            tup = keylib.unpacks(raw)[0][:length]
+            seen[tup] = seen.get(tup, 0) + 1
+        popular = [n for n in seen.itervalues() if n > 1]
+        rest = stats['count'] - (depth * sum(n - 1 for n in popular))
+        ndv = stats['distinct'][length - 1] - len(popular)
+        return max(0, rest) // max(1, ndv)
+
     def _iter(self, key, lo, hi, prefix, reverse, max, include):
         """Setup a woeful chain of iterators that yields index entries.
         """
+        if not self.ready:
+            raise errors.ConfigError('%r is not built; see Index.build()' %
+                                     (self,))
         txn = self.store._txn_context.get()
         it = iterators.BasicIterator(txn, self.prefix)
         return iterators.from_args(it,
@@ -294,29 +724,60 @@ class Index(object):
         return (e.keys[1] for e in it)
 
     def items(self, args=None, lo=None, hi=None, prefix=None, reverse=None,
-              max=None, include=False, raw=False):
+              max=None, include=False, raw=False, covered=False):
         """Yield all `(key, value)` items referred to by the index, in tuple
-        order."""
-        get = self.coll.get
-        for e in self._iter(args, lo, hi, prefix, reverse, max, include):
+        order. Records are fetched using :py:meth:`Collection.get_many` for
+        each :py:attr:`JOIN_CHUNK` index entries.
+
+        If `covered` is ``True``, instead yield `(key, tuple)`, where `tuple`
+        is the output of the index's cover function stored in the entry, so
+        records need not be fetched."""
+        it = self._iter(args, lo, hi, prefix, reverse, max, include)
+        if covered:
+            if self.cover is None:
+                raise ValueError('%r has no cover function' % (self,))
+            return self._covered_items(it)
+        return self._join_items(it, raw)
+
+    def _covered_items(self, it):
+        for e in it:
             key = e.keys[1]
-            obj = get(key, None, raw)
-            if obj:
-                yield key, obj
+            if e.data:
+                yield key, keylib.unpack(e.data)
+                continue
+            # Entry written before the cover function was given.
+            obj = self.coll.get(key)
+            if obj is not None:
+                yield key, keylib.unpack(keylib.packs(self.cover(obj)))
             else:
                 warnings.warn('stale entry in %r, requires rebuild' % (self,))
 
+    def _join_items(self, it, raw):
+        while True:
+            keys = [e.keys[1] for e in itertools.islice(it, self.JOIN_CHUNK)]
+            if not keys:
+                break
+            objs = self.coll.get_many(keys, None, raw)
+            for key, obj in itertools.izip(keys, objs):
+                if obj is not None:
+                    yield key, obj
+                else:
+                    warnings.warn('stale entry in %r, requires rebuild' %
+                                  (self,))
+
     def values(self, args=None, lo=None, hi=None, prefix=None, reverse=None,
-               max=None, include=False, raw=False):
-        """Yield all values referred to by the index, in tuple order."""
-        it = self.items(args, lo, hi, prefix, reverse, max, include, raw)
+               max=None, include=False, raw=False, covered=False):
+        """Yield all values referred to by the index, in tuple order. See
+        :py:meth:`items` for the meaning of `covered`."""
+        it = self.items(args, lo, hi, prefix, reverse, max, include, raw,
+                        covered)
         return itertools.imap(ITEMGETTER_1, it)
 
     def find(self, args=None, lo=None, hi=None, prefix=None, reverse=None,
              include=False, raw=False, default=None):
         """Return the first matching record from the index, or None. Like
         ``next(itervalues(), default)``."""
-        it = self.items(args, lo, hi, prefix, reverse, None, include, raw)
+        it = self.items(args, lo, hi, prefix, reverse, 1, include, raw)
         for tup in it:
             return tup[1]
         return default
@@ -329,11 +790,255 @@ class Index(object):
 
     def get(self, x, default=None, raw=False):
         """Return the first matching record from the index."""
-        for tup in self.items(x, raw=raw):
+        for tup in self.items(x, max=1, raw=raw):
             return tup[1]
         return default
 
 
+class Condition(object):
+    """Base for conditions passed to :py:meth:`Collection.query`. A condition
+    matches index tuples or record keys using the same ordering as
+    :py:meth:`Index.pairs`."""
+    args = lo = hi = prefix = None
+    include = False
+
+    def _init_bounds(self):
+        """Compute the encoded bounds used by :py:meth:`matches`."""
+        if self.args is not None:
+            self._lo = self._hi = self.args.to_raw()
+            self._closed = True
+        elif self.prefix is not None:
+            self._lo = self.prefix.to_raw()
+            bound = self.prefix.prefix_bound()
+            self._hi = bound and bound.to_raw()
+            self._closed = False
+        else:
+            self._lo = None if self.lo is None else self.lo.to_raw()
+            self._hi = None if self.hi is None else self.hi.to_raw()
+            self._closed = self.include
+
+    def matches(self, raw):
+        """Return ``True`` if the encoded tuple `raw` satisfies the condition.
+        """
+        if self._lo is not None and raw < self._lo:
+            return False
+        if self._hi is not None:
+            return raw <= self._hi if self._closed else raw < self._hi
+        return True
+
+    def estimate(self, index):
+        """Return the estimated number of entries matching in `index`, or
+        ``None`` if it has no statistics."""
+        return index.estimate(self.args, self.lo, self.hi, self.prefix)
+
+    def entries(self, index):
+        """Return an iterator yielding matching entries from `index`."""
+        return index._iter(self.args, self.lo, self.hi, self.prefix,
+                           None, None, self.include)
+
+    def records(self, coll):
+        """Return an iterator yielding records from `coll` whose keys match.
+        """
+        return coll._iter(self.args, self.lo, self.hi, self.prefix,
+                          None, None, self.include, None)
+
+
+class Equal(Condition):
+    """Match index tuples or keys equal to `value`. Plain values passed to
+    :py:meth:`Collection.query` are wrapped in this class."""
+    #: Fraction of records assumed to match when no statistics exist.
+    SELECTIVITY = 0.1
+
+    def __init__(self, value):
+        self.args = keylib.Key(value)
+        self._init_bounds()
+
+    def __repr__(self):
+        return 'Equal(%r)' % (self.args,)
+
+
+class Prefix(Condition):
+    """Match index tuples or keys beginning with `prefix`."""
+    SELECTIVITY = 0.25
+
+    def __init__(self, prefix):
+        self.prefix = keylib.Key(prefix)
+        self._init_bounds()
+
+    def __repr__(self):
+        return 'Prefix(%r)' % (self.prefix,)
+
+
+class Range(Condition):
+    """Match index tuples or keys `>= lo` and `< hi`, or `<= hi` if `include`
+    is ``True``. Either bound may be ``None``."""
+    SELECTIVITY = 0.33
+
+    def __init__(self, lo=None, hi=None, include=False):
+        self.lo = None if lo is None else keylib.Key(lo)
+        self.hi = None if hi is None else keylib.Key(hi)
+        self.include = include
+        self._init_bounds()
+
+    def __repr__(self):
+        return 'Range(%r, %r, include=%r)' % (self.lo, self.hi, self.include)
+
+
+class Plan(object):
+    """Describes how :py:meth:`Collection.query` will find matching records.
+    Produced by :py:meth:`Collection.plan`.
+
+        `kind`:
+            ``"scan"`` to read the whole collection, ``"key"`` to read a range
+            of record keys, ``"index"`` to fetch records named by one index,
+            or ``"intersect"`` to fetch only records named by every index in
+            :py:attr:`indices`.
+
+        `indices`:
+            List of names of indices read.
+
+        `rows`:
+            Estimated number of records read.
+
+        `cost`:
+            Estimated cost, in units of records read sequentially.
+    """
+    #: Cost of visiting one index entry.
+    ENTRY_COST = 0.2
+    #: Cost of fetching one record by key.
+    FETCH_COST = 2.0
+    #: Collection size assumed when no index statistics exist.
+    DEFAULT_ROWS = 1000
+    #: Largest estimated number of entries matching in the most selective
+    #: index for which intersection is considered, since the record keys
+    #: they name are held in memory.
+    INTERSECT_MAX = 100000
+
+    def __init__(self, coll, kind, rows, cost, key, used, residual):
+        self.coll = coll
+        self.kind = kind
+        self.indices = [name for name, _, _ in used]
+        self.rows = rows
+        self.cost = cost
+        self._key = key
+        self._used = used
+        self._residual = residual
+
+    def __repr__(self):
+        return '<Plan %s(%s) rows=%d cost=%.1f>' % (
+            self.kind, ', '.join(self.indices), self.rows, self.cost)
+
+    @classmethod
+    def choose(cls, coll, key, terms):
+        """Return the cheapest :py:class:`Plan` for matching `key`, a
+        :py:class:`Condition` on the record key or ``None``, and `terms`, a
+        list of `(name, index, condition)` tuples."""
+        keyterm = [] if key is None else [(None, None, key)]
+        usable = [t for t in terms if t[1].ready]
+        stats = filter(None, (idx.stats() for _, idx, _ in usable))
+        total = max([st['count'] for st in stats] or [cls.DEFAULT_ROWS])
+
+        plans = [cls(coll, 'scan', total, total, None, [], terms + keyterm)]
+        if key is not None:
+            rows = 1 if key.args is not None else total * key.SELECTIVITY
+            plans.append(cls(coll, 'key', rows, rows, key, [], terms))
+
+        scored = []
+        for name, idx, cond in usable:
+            est = cond.estimate(idx)
+            if est is None:
+                est = total * cond.SELECTIVITY
+            scored.append((est, (name, idx, cond)))
+        scored.sort(key=ITEMGETTER_0)
+
+        # Consider the most selective index alone, then intersected with each
+        # next most selective, assuming conditions are independent.
+        entries = 0
+        rows = total
+        for i, (est, term) in enumerate(scored):
+            if i and scored[0][0] > cls.INTERSECT_MAX:
+                break
+            entries += est
+            rows *= float(est) / max(1, total)
+            used = [t for _, t in scored[:i + 1]]
+            rest = [t for t in terms if t not in used] + keyterm
+            cost = (entries * cls.ENTRY_COST) + (rows * cls.FETCH_COST)
+            kind = 'intersect' if i else 'index'
+            plans.append(cls(coll, kind, rows, cost, None, used, rest))
+        return min(plans, key=operator.attrgetter('cost'))
+
+    def _accept(self, key, obj):
+        """Return ``True`` if the record satisfies every condition not already
+        satisfied by the access path."""
+        for _, idx, cond in self._residual:
+            if idx is None:
+                if not cond.matches(keylib.Key(key).to_raw()):
+                    return False
+                continue
+            if idx.where is not None and not idx._selected(obj):
+                return False
+            res = idx.func(obj)
+            if res is None:
+                return False
+            if type(res) is not list:
+                res = [res]
+            if not any(cond.matches(keylib.packs(ik)) for ik in res):
+                return False
+        return True
+
+    def _candidates(self):
+        """Yield `(key, obj)` for records read by the access path."""
+        coll = self.coll
+        if self.kind == 'scan':
+            it = coll._iter(None, None, None, None, None, None, None, None)
+        elif self.kind == 'key':
+            it = self._key.records(coll)
+        else:
+            return self._fetch()
+        return ((r.key, coll.encoder.unpack(r.key, r.data)) for r in it)
+
+    def _fetch(self):
+        """Yield records named by index entries, fetching each once."""
+        if self.kind == 'index':
+            _, idx, cond = self._used[0]
+            seen = set()
+            for key, obj in idx._join_items(cond.entries(idx), False):
+                if key not in seen:
+                    seen.add(key)
+                    yield key, obj
+            return
+
+        # Only keys named by the most selective index are held, while entries
+        # of the others are streamed to discard keys they do not name.
+        _, idx, cond = self._used[0]
+        keys = set(e.keys[1] for e in cond.entries(idx))
+        for _, idx, cond in self._used[1:]:
+            if not keys:
+                break
+            found = set()
+            for e in cond.entries(idx):
+                if e.keys[1] in keys:
+                    found.add(e.keys[1])
+            keys = found
+        keys = sorted(keys)
+        for i in xrange(0, len(keys), Index.JOIN_CHUNK):
+            chunk = keys[i:i + Index.JOIN_CHUNK]
+            for key, obj in itertools.izip(chunk, self.coll.get_many(chunk)):
+                if obj is not None:
+                    yield key, obj
+
+    def execute(self, where=None, max=None):
+        """Yield `(key, value)` for matching records, additionally filtered by
+        `where` and limited to `max` results."""
+        it = self._candidates()
+        it = (kv for kv in it if self._accept(*kv))
+        if where is not None:
+            it = (kv for kv in it if where(kv[1]))
+        if max is not None:
+            it = itertools.islice(it, max)
+        return it
+
+
 class BasicStrategy(object):
     """Access strategy for 'basic' ordered collections, i.e. those containing
     no batch records, or the metadata collection."""
@@ -362,32 +1067,115 @@ class BasicStrategy(object):
         """Implement `pop()` as `Engine.pop(key)`."""
         return txn.pop(key.to_raw(self.prefix))
 
+    def get_many(self, txn, keys):
+        """Implement `get_many()` using :py:func:`sweep_get`."""
+        return sweep_get(self, txn, keys)
+
     def iter(self, txn):
         """Implement `iter()` using :py:class:`acid.iterators.BasicIterator`.
         """
         return iterators.BasicIterator(txn, self.prefix)
 
 
+class _SizeEstimate(object):
+    """Tracks an estimate of the compressed size of a batch as members are
+    appended, by feeding them to the compressor's streaming interface. The
+    estimate is rebased on the exact size whenever the batch is fully
+    compressed, so errors do not accumulate.
+    """
+    def __init__(self, compressor):
+        self.compressor = compressor
+        self.reset()
+
+    def reset(self):
+        """Begin estimating a new, empty batch."""
+        stream = self.compressor.stream
+        self._stream = stream() if stream else None
+        #: Bytes output by the stream so far.
+        self._streamed = 0
+        #: Exact size at the last :py:meth:`rebase`.
+        self._base = 0
+        #: Value of `_streamed` at the last :py:meth:`rebase`.
+        self._base_streamed = 0
+
+    def append(self, key, data):
+        """Account for a new member, returning the updated estimate."""
+        stream = self._stream
+        # Allow 3 bytes for the member's offset table entry and key length.
+        if stream is None:
+            # Uncompressed; assume the member is stored as is.
+            self._streamed += 3 + len(key.to_raw()) + len(data)
+        else:
+            self._streamed += 3 + len(stream.compress(key.to_raw()))
+            self._streamed += len(stream.compress(bytes(data)))
+            self._streamed += len(stream.flush())
+        return self._base + (self._streamed - self._base_streamed)
+
+    def rebase(self, exact):
+        """Replace the estimate for the members so far with `exact`."""
+        self._base = exact
+        self._base_streamed = self._streamed
+
+
+class _BatchV1Builder(object):
+    """Accumulates the members of a batch record for
+    :py:class:`BatchStrategy`."""
+    def __init__(self):
+        #: List of `(key, data)` tuples.
+        self.items = []
+
+    def __len__(self):
+        return len(self.items)
+
+    def append(self, key, data):
+        self.items.append((key, data))
+
+    def pop(self):
+        self.items.pop()
+
+    def clear(self):
+        del self.items[:]
+
+    def keys(self):
+        return [key for key, _ in self.items]
+
+
 class BatchStrategy(object):
     """Access strategy for ordered collections containing batch records.
     """
     ITERATOR_CLASS = iterators.BatchIterator
+    #: If ``True``, estimate the compressed size of batches using the
+    #: compressor's streaming interface during :py:meth:`batch`.
+    _ESTIMATE_SIZE = True
+    #: If ``True``, also estimate the size of uncompressed batches from the
+    #: size of their members, for formats whose exact size is costly.
+    _ESTIMATE_PLAIN = False
 
     def __init__(self, prefix, store, compressor):
         self.prefix = prefix
         self.store = store
         self.compressor = compressor
+        #: Limits enforced when a batch grows due to :py:meth:`put`, set from
+        #: the `max_recs` and `max_bytes` of :py:class:`Collection`.
+        self.max_recs = None
+        self.max_bytes = None
 
     def get(self, txn, key):
         """Implement `get()` using a range query over `>= key`."""
-        it = self.ITERATOR_CLASS(txn, self.prefix, self.compressor)
+        it = self.iter(txn)
         it.set_exact(key)
         for res in it.forward():
             return bytes(res.data)  # TODO: buf dies at cursor exit
 
-    def _prepare_batch(self, items):
-        """Encode a list of records into their batch representation, returning
-        a tuple of the encoded physical key and value."""
+    def _new_builder(self):
+        """Return an empty batch builder; see
+        :py:class:`acid.iterators.BatchV2Builder` for its interface."""
+        return _BatchV1Builder()
+
+    def _prepare_batch(self, builder):
+        """Encode the members of `builder` into their batch representation,
+        returning a tuple of the encoded physical key and value."""
+        items = builder.items
         keytups = [key for key, _ in reversed(items)]
         phys = keylib.packs(keytups, self.prefix)
 
@@ -402,6 +1190,11 @@ class BatchStrategy(object):
             out.extend(self.compressor.pack(concat))
         return phys, bytes(out)
 
+    def _encoded_size(self, builder):
+        """Return the length of the value :py:meth:`_prepare_batch` would
+        produce for `builder`."""
+        return len(self._prepare_batch(builder)[1])
+
     def batch(self, lo=None, hi=None, prefix=None, max_recs=None,
               max_bytes=None, max_keylen=None, preserve=True,
               max_phys=None, grouper=None):
@@ -438,8 +1231,15 @@ class BatchStrategy(object):
                 ``None``, values are recompressed after each member is
                 appended, in order to test if `max_bytes` has been reached. This
                 is inefficient, but provides the best guarantee of final record
-                size. Single records are skipped if they exceed this size when
-                compressed individually.
+                size. Uncompressed batches avoid this cost, since their size is
+                maintained as members are appended, except for the
+                ``"columnar"`` strategy, whose uncompressed size is estimated
+                from the size of each member. For compressors supporting
+                streaming, such as :py:attr:`acid.encoders.ZLIB`, the
+                compressed size is estimated as members are appended, and
+                recompression occurs only once the estimate exceeds
+                `max_bytes`. Single records are skipped if they exceed this
+                size when compressed individually.
 
             `preserve`:
                 If ``True``, then existing batch records in the database are
@@ -461,79 +1261,186 @@ class BatchStrategy(object):
             `grouper`:
                 Specifies a grouping function used to decide when to avoid
                 compressing unrelated records. The function is passed a
-                record's value. A new batch is triggered each time the
-                function's return value changes.
+                record's key and encoded value. A new batch is triggered each
+                time the function's return value changes.
 
         """
         assert max_bytes or max_recs, 'max_bytes and/or max_recs is required.'
 
         txn = self.store._txn_context.get()
-        it = self.ITERATOR_CLASS(txn, self.prefix, self.compressor)
+        it = self.iter(txn)
         groupval = object()
-        items = []
+        builder = self._new_builder()
+        estimate = None
+        if max_bytes and self._ESTIMATE_SIZE and \
+                (self.compressor.stream or self._ESTIMATE_PLAIN):
+            estimate = _SizeEstimate(self.compressor)
+        found = 0
+        made = 0
+        last_key = None
 
         for r in iterators.from_args(it, None, lo, hi, prefix,
                                      False, None, True, max_phys):
+            last_key = r.key
             if preserve and len(r.keys) > 1:
-                self._write_batch(txn, items, self.compressor)
+                made += self._write_batch(txn, builder)
             else:
                 txn.delete(keylib.packs(r.key, self.prefix))
-                items.append((r.key, r.data))
-                if max_bytes:
-                    _, encoded = self._prepare_batch(items)
-                    if len(encoded) > max_bytes:
-                        items.pop()
-                        self._write_batch(txn, items)
-                        items.append((r.key, r.data))
-                done = max_recs and len(items) == max_recs
-                if (not done) and grouper:
-                    val = grouper(self.encoder.unpack(r.key, r.data))
-                    done = val != groupval
-                    groupval = val
-                if done:
-                    self._write_batch(txn, items)
-        self._write_batch(txn, items)
-
-    def _write_batch(self, txn, items):
-        if items:
-            phys, data = self._prepare_batch(items)
+                found += 1
+                if grouper:
+                    val = grouper(r.key, r.data)
+                    if val != groupval:
+                        made += self._write_batch(txn, builder)
+                        groupval = val
+                builder.append(r.key, r.data)
+                if max_bytes and self._too_large(builder, estimate, r.key,
+                                                 r.data, max_bytes):
+                    builder.pop()
+                    made += self._write_batch(txn, builder)
+                    builder.append(r.key, r.data)
+                    if estimate:
+                        estimate.reset()
+                        estimate.append(r.key, r.data)
+                if max_recs and len(builder) == max_recs:
+                    made += self._write_batch(txn, builder)
+        made += self._write_batch(txn, builder)
+        return found, made, last_key
+
+    def _too_large(self, builder, estimate, key, data, max_bytes):
+        """Return ``True`` if the encoded size of `builder` exceeds
+        `max_bytes` following the append of `key` and `data`. When `estimate`
+        is not ``None``, the batch is only compressed once the estimate
+        exceeds `max_bytes`."""
+        if estimate is None:
+            return self._encoded_size(builder) > max_bytes
+        if len(builder) == 1:
+            estimate.reset()
+        if estimate.append(key, data) <= max_bytes:
+            return False
+        exact = self._encoded_size(builder)
+        if exact > max_bytes:
+            return True
+        estimate.rebase(exact)
+        return False
+
+    def _write_batch(self, txn, builder):
+        """Write any members of `builder` as a single record, then empty it.
+        Return the number of records written."""
+        if len(builder):
+            phys, data = self._prepare_batch(builder)
             txn.put(phys, data)
-            del items[:]
+            self._discard(phys)
+            builder.clear()
+            return 1
+        return 0
+
+    def get_many(self, txn, keys):
+        """Implement `get_many()` using :py:func:`sweep_get`."""
+        return sweep_get(self, txn, keys)
 
     def iter(self, txn):
         """Implement `iter()` using
-        :py:class:`acid.iterators.BatchIterator`."""
-        return self.ITERATOR_CLASS(txn, self.prefix, self.compressor)
+        :py:class:`acid.iterators.BatchIterator`, sharing the transaction's
+        :py:class:`acid.iterators.BatchCache` unless batches are
+        uncompressed."""
+        cache = None
+        if self.compressor is not encoders.PLAIN:
+            cache = self.store._batch_cache()
+        return self.ITERATOR_CLASS(txn, self.prefix, self.compressor, cache)
+
+    def _discard(self, phys_key):
+        """Drop any cached payload for the batch at `phys_key` following a
+        write to it."""
+        cache = self.store._batch_local.cache
+        if cache is not None:
+            cache.discard(bytes(phys_key))
 
     def pop(self, txn, key):
         """Implement `pop()` using a range query to find the single or batch
-        record `key` belongs to and splitting it, saving all records
-        individually except for `key`. Return the data for `key` if it existed,
-        otherwise ``None``."""
-        it = self.ITERATOR_CLASS(txn, self.prefix, self.compressor)
+        record `key` belongs to. A batch is rewritten without `key`, rather
+        than split into individual records. Return the data for `key` if it
+        existed, otherwise ``None``."""
+        return self._update(txn, key, None)
+
+    def replace(self, txn, key, data):
+        """Implement `replace()` using a range query to find the single or
+        batch record `key` belongs to. If `key` falls within a batch, the batch
+        is rewritten to contain the new value, otherwise the record is written
+        individually. Return the old value, or ``None``."""
+        return self._update(txn, key, data)
+
+    def _update(self, txn, key, data):
+        """Replace the value of `key` with `data`, or remove `key` if `data`
+        is ``None``, returning the old value or ``None``."""
+        it = self.iter(txn)
         it.set_lo(key)
         for res in it.forward():
-            old = None
             if len(res.keys) == 1:
                 if res.key == key:
                     old = res.data
-                    txn.delete(it.phys_key)
-            elif res.keys[0] >= key >= res.keys[-1]:
-                txn.delete(it.phys_key)
-                for key_, data in it.batch_items():
-                    if key == key_:
-                        old = data
+                    if data is None:
+                        txn.delete(it.phys_key)
                     else:
-                        txn.put(key_.to_raw(self.prefix), data)
-            return old
-
-    def replace(self, txn, key, data):
-        """Implement `replace()` by popping any existing value, then writing
-        out the new record and returning the old value."""
-        old = self.pop(txn, key)
-        txn.put(key.to_raw(self.prefix), data)
+                        old = bytes(old)
+                        txn.put(it.phys_key, data)
+                    return old
+            elif res.keys[0] >= key >= res.keys[-1]:
+                return self._rewrite(txn, it, key, data)
+            break
+        if data is not None:
+            txn.put(key.to_raw(self.prefix), data)
+
+    def _rewrite(self, txn, it, key, data):
+        """Rewrite the batch at `it` with `key` replaced by `data`, or removed
+        if `data` is ``None``, splitting it as described for
+        :py:meth:`_write_items`. Return the old value of `key`, or
+        ``None``."""
+        old = None
+        items = []
+        for key_, data_ in sorted(it.batch_items()):
+            if key_ == key:
+                old = bytes(data_)
+            else:
+                items.append((key_, data_))
+        if data is not None:
+            bisect.insort(items, (key, data))
+
+        old_phys = bytes(it.phys_key)
+        txn.delete(old_phys)
+        self._discard(old_phys)
+        self._write_items(txn, items)
         return old
 
+    def _write_items(self, txn, items):
+        """Write the sorted `(key, data)` list `items` as a single batch. If
+        it exceeds :py:attr:`max_recs` or :py:attr:`max_bytes`, or cannot be
+        encoded, instead split it at its midpoint and write each half
+        likewise, so a batch grown by repeated inserts divides in two rather
+        than into individual records."""
+        if len(items) == 1:
+            key, data = items[0]
+            txn.put(key.to_raw(self.prefix), data)
+            return
+        value = None
+        if not (self.max_recs and len(items) > self.max_recs):
+            builder = self._new_builder()
+            for key, data in items:
+                builder.append(key, data)
+            try:
+                phys, value = self._prepare_batch(builder)
+            except ValueError:
+                pass
+            if self.max_bytes and value is not None \
+                    and len(value) > self.max_bytes:
+                value = None
+        if value is None:
+            mid = len(items) // 2
+            self._write_items(txn, items[:mid])
+            self._write_items(txn, items[mid:])
+        else:
+            txn.put(phys, value)
+            self._discard(phys)
+
     #: Alias for `pop()` (which satisfies the `delete()` interface).
     delete = pop
     #: Alias for `replace()` (which satisfies the `put()` interface).
@@ -545,29 +1452,80 @@ class BatchV2Strategy(BatchStrategy):
     """
     ITERATOR_CLASS = iterators.BatchV2Iterator
 
-    def _prepare_batch(self, items):
-        if len(items) == 1:
-            phys = keylib.Key(items[0][0]).to_raw(self.prefix)
-            return phys, items[0][1]
+    def _new_builder(self):
+        return iterators.BatchV2Builder()
+
+    def _prepare_batch(self, builder):
+        keys = builder.keys()
+        if len(keys) == 1:
+            return keys[0].to_raw(self.prefix), builder.build()
+        phys = keylib.packs([keys[-1], keys[0]], self.prefix)
+        return phys, self.compressor.pack(builder.build())
+
+    def _encoded_size(self, builder):
+        # Single records and uncompressed batches are stored as built.
+        if len(builder) == 1 or self.compressor is encoders.PLAIN:
+            return builder.size()
+        return len(self.compressor.pack(builder.build()))
+
+
+class BatchV3Strategy(BatchV2Strategy):
+    """Access strategy for ordered collections containing random access batch
+    records. Batch values are split into independently compressed blocks, so
+    :py:meth:`get` need only decompress the block containing the requested
+    record.
+    """
+    ITERATOR_CLASS = iterators.BatchV3Iterator
+    #: Target uncompressed size of each independently compressed block.
+    BLOCK_SIZE = 4096
+    # The encoded size is maintained exactly by the builder.
+    _ESTIMATE_SIZE = False
+
+    def _new_builder(self):
+        return iterators.BatchV3Builder(self.compressor, self.BLOCK_SIZE)
+
+    def _prepare_batch(self, builder):
+        keys = builder.keys()
+        if len(keys) == 1:
+            return keys[0].to_raw(self.prefix), builder.build()
+        phys = keylib.packs([keys[-1], keys[0]], self.prefix)
+        return phys, builder.build()
+
+    def _encoded_size(self, builder):
+        return builder.size()
+
+    def get(self, txn, key):
+        """Implement `get()` using :py:meth:`BatchV3Iterator.find
+        <acid.iterators.BatchV3Iterator.find>`."""
+        it = self.iter(txn)
+        return it.find(key)
+
 
-        high_key_s = items[-1][0].to_raw()
-        low_key_s = items[0][0].to_raw()
-        cp_len = iterators.common_prefix_len(high_key_s, low_key_s)
+class ColumnarStrategy(BatchV2Strategy):
+    """Access strategy for ordered collections of
+    :py:class:`acid.structlib.Struct` records whose batches store each field
+    contiguously, so a batch compresses as runs of similar values, and
+    :py:meth:`Collection.project` need only decode the requested fields.
+    """
+    ITERATOR_CLASS = iterators.ColumnarBatchIterator
+    # Measuring the builder encodes every column.
+    _ESTIMATE_PLAIN = True
+
+    def __init__(self, prefix, store, compressor, struct_type):
+        BatchV2Strategy.__init__(self, prefix, store, compressor)
+        self.struct_type = struct_type
 
-        raw = bytearray(2 + (2 * (1 + len(items))))
-        raw[0:2] = struct.pack('>HH', len(items), len(raw))
-        for idx, (key, value) in enumerate(items):
-            opos = 2 + (2 * idx)
-            raw[opos:opos+2] = struct.pack('>H', len(raw))
-            suffix = key.to_raw()[cp_len:]
-            raw.append(len(suffix))
-            raw.extend(suffix)
-            raw.extend(value)
+    def _new_builder(self):
+        return iterators.ColumnarBatchBuilder(self.struct_type)
 
-        opos = 2 + (2 * len(items))
-        raw[opos:opos+2] = struct.pack('>H', len(raw))
-        phys = keylib.packs([items[-1][0], items[0][0]], self.prefix)
-        return phys, self.compressor.pack(bytes(raw))
+    def iter(self, txn):
+        """Implement `iter()` using
+        :py:class:`acid.iterators.ColumnarBatchIterator`."""
+        cache = None
+        if self.compressor is not encoders.PLAIN:
+            cache = self.store._batch_cache()
+        return self.ITERATOR_CLASS(txn, self.prefix, self.compressor,
+                                   self.struct_type, cache)
 
 
 class Collection(object):
@@ -599,34 +1557,72 @@ class Collection(object):
             Specifies the name of the :py:class:`Store` counter to use when
             generating auto-incremented keys. If unspecified, defaults to
             ``"key:<name>"``. Unused when `key_func` is specified.
+
+        `counter_block`:
+            If not ``None``, auto-incremented keys are handed out from ranges
+            of `counter_block` values reserved with a single counter update,
+            using :py:meth:`Store.lease`. This avoids writing the counter for
+            every insert, at the cost of skipping values left unused when the
+            process exits. Unused when `key_func` is specified.
+
+        `max_recs`, `max_bytes`:
+            Limits applied when :py:meth:`put` inserts a record into an
+            existing batch; a batch exceeding them is split in two. If
+            unspecified, defaults to the limits saved by
+            :py:meth:`Store.add_collection`, otherwise batches may grow
+            without bound.
     """
     def __init__(self, store, info, key_func=None, encoder=None,
-                 compressor=None, counter_name=None):
+                 compressor=None, counter_name=None, counter_block=None,
+                 max_recs=None, max_bytes=None):
         """Create an instance; see class docstring."""
         self.store = store
         self.engine = store.engine
         self.info = info
 
+        self.encoder = encoder or encoders.JSON
         prefix = keylib.pack_int(info['idx'], self.store.prefix)
-        if info.get('strategy', 'batch') == 'batch':
+        strategy = info.get('strategy', 'batch')
+        if strategy == 'batch':
             compressor = compressor or encoders.PLAIN
             self.strategy = BatchV2Strategy(prefix, store, compressor)
+        elif strategy == 'batch3':
+            compressor = compressor or encoders.PLAIN
+            self.strategy = BatchV3Strategy(prefix, store, compressor)
+        elif strategy == 'columnar':
+            struct_type = getattr(self.encoder, 'struct_type', None)
+            if struct_type is None:
+                raise errors.ConfigError('columnar strategy requires an '
+                                         'encoder from make_struct_encoder()')
+            compressor = compressor or encoders.PLAIN
+            self.strategy = ColumnarStrategy(prefix, store, compressor,
+                                             struct_type)
         else:
             assert info['strategy'] == 'basic'
             self.strategy = BasicStrategy(prefix)
 
+        if isinstance(self.strategy, BatchStrategy):
+            self.strategy.max_recs = max_recs or info.get('max_recs')
+            self.strategy.max_bytes = max_bytes or info.get('max_bytes')
+
         if key_func:
             self.key_func = key_func
+        elif counter_block:
+            counter_name = counter_name or ('key:%(name)s' % self.info)
+            self.key_func = lambda _: store.lease(counter_name, counter_block)
         else:
             counter_name = counter_name or ('key:%(name)s' % self.info)
             self.key_func = lambda _: store.count(counter_name)
 
-        self.encoder = encoder or encoders.JSON
-        self._on_update = []
-        self._after_create = []
-        self._after_replace = []
-        self._after_delete = []
-        self._after_update = []
+        #: Mapping of index name to :py:class:`Index` instance, populated by
+        #: :py:func:`acid.add_index`.
+        self.indices = {}
+        self._unique_indices = []
+        self._on_update = Dispatcher()
+        self._after_create = Dispatcher()
+        self._after_replace = Dispatcher()
+        self._after_delete = Dispatcher()
+        self._after_update = Dispatcher()
         # Copied verbatim to allow proxying.
         self._on_commit = store._on_commit
         self._after_commit = store._after_commit
@@ -670,6 +1666,89 @@ class Collection(object):
             return (bytes(r.data) for r in it)
         return (self.encoder.unpack(r.key, r.data) for r in it)
 
+    def project(self, fields, key=None, lo=None, hi=None, prefix=None,
+                reverse=None, max=None, include=False):
+        """Yield `(key tuple, values)` in key order, where `values` is a tuple
+        of each record's attributes named by the sequence `fields`, or
+        ``None`` where unset. For the ``"columnar"`` strategy, only the
+        requested fields of each batch are decoded. For other strategies
+        using :py:func:`acid.encoders.make_struct_encoder`, only the requested
+        fields of each record are decoded, otherwise records are decoded in
+        full and read using the encoder's `get` function."""
+        it = self.strategy.iter(self.store._txn_context.get())
+        if hasattr(it, 'set_fields'):
+            it.set_fields(fields)
+            it = iterators.from_args(it, key, lo, hi, prefix, reverse,
+                                     max, include, None)
+            return ((r.key, r.values) for r in it)
+        struct_type = getattr(self.encoder, 'struct_type', None)
+        if struct_type is not None:
+            names = tuple(fields)
+            wanted = struct_type.projection(names)
+            project = structlib.project_fields
+            it = self._iter(key, lo, hi, prefix, reverse, max, include, None)
+            return ((r.key, project(bytes(r.data), wanted, len(names)))
+                    for r in it)
+        get = self.encoder.get
+        it = self.items(key, lo, hi, prefix, reverse, max, include)
+        return ((key_, tuple(get(obj, name, None) for name in fields))
+                for key_, obj in it)
+
+    def _terms(self, conds):
+        """Return `(name, index, condition)` tuples for the keyword arguments
+        of :py:meth:`query`."""
+        terms = []
+        for name, cond in sorted(conds.iteritems()):
+            if name not in self.indices:
+                raise ValueError('%r has no index %r' % (self, name))
+            if not isinstance(cond, Condition):
+                cond = Equal(cond)
+            terms.append((name, self.indices[name], cond))
+        return terms
+
+    def plan(self, key=None, **conds):
+        """Return the :py:class:`Plan` :py:meth:`query` would use for the same
+        arguments."""
+        if key is not None and not isinstance(key, Condition):
+            key = Equal(key)
+        return Plan.choose(self, key, self._terms(conds))
+
+    def query(self, key=None, where=None, max=None, **conds):
+        """Yield `(key, value)` for records matching every condition, choosing
+        between reading the whole collection, a range of keys, a single index,
+        or the intersection of several indices based on statistics collected
+        by :py:meth:`Index.analyze`. Records are yielded in key order, except
+        for single index plans, which yield them in index order.
+
+            `key`:
+                Condition on the record key.
+
+            `where`:
+                Function invoked as `where(value)` for records matching every
+                other condition, returning ``True`` if the record should be
+                yielded.
+
+            `max`:
+                Maximum number of records to yield.
+
+            `**conds`:
+                Keyword arguments naming an index in :py:attr:`indices`, with
+                a :py:class:`Condition` such as :py:class:`Range`,
+                :py:class:`Prefix`, or a plain value to match index tuples
+                equal to it. A record matches if any of its index tuples do.
+
+        Conditions not satisfied by the chosen plan are tested against each
+        candidate record by invoking the index function, before `where`.
+
+        ::
+
+            people = store.add_collection('people')
+            acid.add_index(people, 'age', lambda p: p['age'])
+            acid.add_index(people, 'city', lambda p: p['city'])
+            adults = people.query(age=acid.Range(18), city=u'London')
+        """
+        return self.plan(key, **conds).execute(where, max)
+
     def find(self, key=None, lo=None, hi=None, prefix=None, reverse=None,
              include=False, raw=None, default=None):
         """Return the first matching record, or None. Like ``next(itervalues(),
@@ -702,6 +1781,25 @@ class Collection(object):
             return self.encoder.unpack(key, data)
         return default
 
+    def get_many(self, keys, default=None, raw=False):
+        """Return a list of records given a sequence of keys, in the same
+        order, substituting `default` for any that do not exist. Keys are
+        sorted so that records are fetched in a single forward sweep of the
+        collection, reseeking only to skip large gaps between keys."""
+        keys = [keylib.Key(key) for key in keys]
+        txn = self.store._txn_context.get()
+        found = dict(self.strategy.get_many(txn, sorted(set(keys))))
+        out = []
+        for key in keys:
+            data = found.get(key)
+            if data is None:
+                out.append(default)
+            elif raw:
+                out.append(data)
+            else:
+                out.append(self.encoder.unpack(key, data))
+        return out
+
     def put(self, rec, key=None):
         """Create or overwrite a record.
 
@@ -717,7 +1815,9 @@ class Collection(object):
         if key is None:
             key = self.key_func(rec)
         key = keylib.Key(key)
-        dispatch(self._on_update, key, rec)
+        self._on_update(key, rec)
+        for index in self._unique_indices:
+            index._check_unique(txn, [(key, rec)])
         new = self.encoder.pack(rec)
 
         # If a listener is registered that must observe the prior record value,
@@ -727,15 +1827,109 @@ class Collection(object):
             old = self.strategy.replace(txn, key, new)
             if old:
                 oldrec = self.encoder.unpack(key, old)
-                dispatch(self._after_replace, key, oldrec, rec)
+                self._after_replace(key, oldrec, rec)
             elif self._after_create:
-                dispatch(self._after_create, key, rec)
+                self._after_create(key, rec)
         else:
             self.strategy.put(txn, key, new)
 
-        dispatch(self._after_update, key, rec)
+        self._after_update(key, rec)
         return key
 
+    def put_many(self, recs, keys=None):
+        """Create or overwrite many records at once, returning a list of their
+        keys in the order of `recs`. Equivalent to calling :py:meth:`put` for
+        each record, except records are written in key order, and any index
+        entries are written afterwards in key order. This improves locality of
+        engine access when importing large numbers of records.
+
+            `recs`:
+                Sequence of values to put.
+
+            `keys`:
+                Optional sequence of keys, one for each record, otherwise
+                assign keys using the collection's key function.
+
+        While the index entries are being accumulated, listeners observe
+        index writes via :py:meth:`Engine.get <acid.engines.Engine.get>`, but
+        not via iteration.
+
+        Unlike separate calls to :py:meth:`put`,
+        :py:func:`acid.events.on_update` listeners run for every record, in
+        the order of `recs`, before any record is written, so a listener
+        never observes earlier records of the same call in the collection.
+        """
+        recs = list(recs)
+        if keys is None:
+            keys = [keylib.Key(self.key_func(rec)) for rec in recs]
+        else:
+            keys = [keylib.Key(key) for key in keys]
+        if len(keys) != len(recs):
+            raise ValueError('put_many() requires one key for each record.')
+
+        for key, rec in itertools.izip(keys, recs):
+            self._on_update(key, rec)
+        pairs = sorted(itertools.izip(keys, recs), key=ITEMGETTER_0)
+
+        ctx = self.store._txn_context
+        for index in self._unique_indices:
+            index._check_unique(ctx.get(), pairs)
+        txn = ctx.swap(WriteBuffer(ctx.get()))
+        try:
+            for key, rec in pairs:
+                new = self.encoder.pack(rec)
+                if self._after_replace or self._after_create:
+                    old = self.strategy.replace(txn, key, new)
+                    if old:
+                        oldrec = self.encoder.unpack(key, old)
+                        self._after_replace(key, oldrec, rec)
+                    elif self._after_create:
+                        self._after_create(key, rec)
+                else:
+                    self.strategy.put(txn, key, new)
+                self._after_update(key, rec)
+        finally:
+            ctx.swap(txn).flush()
+        return keys
+
+    def delete_many(self, keys):
+        """Delete any existing records filed under each key in `keys`.
+        Equivalent to calling :py:meth:`delete` for each key, except records
+        are deleted in key order, and index entries are deleted afterwards in
+        key order."""
+        keys = sorted(keylib.Key(key) for key in keys)
+        ctx = self.store._txn_context
+        txn = ctx.swap(WriteBuffer(ctx.get()))
+        try:
+            for key in keys:
+                if self._after_delete:
+                    data = self.strategy.pop(txn, key)
+                    if data:
+                        obj = self.encoder.unpack(key, data)
+                        self._after_delete(key, obj)
+                else:
+                    self.strategy.delete(txn, key)
+        finally:
+            ctx.swap(txn).flush()
+
+    def batch(self, lo=None, hi=None, prefix=None, max_recs=None,
+              max_bytes=None, preserve=True, max_phys=None, grouper=None):
+        """Combine individual records in the key range *lo..hi* into batches,
+        returning `(found, made, last_key)`. See :py:meth:`BatchStrategy.batch
+        <acid.core.BatchStrategy.batch>` for a description of the arguments,
+        except that `grouper` is passed each decoded record value. Only
+        collections using a batch strategy support this method."""
+        if not hasattr(self.strategy, 'batch'):
+            raise TypeError('%r does not support batching' % (self,))
+        raw_grouper = None
+        if grouper:
+            unpack = self.encoder.unpack
+            raw_grouper = lambda key, data: grouper(unpack(key, data))
+        return self.strategy.batch(lo=lo, hi=hi, prefix=prefix,
+                                   max_recs=max_recs, max_bytes=max_bytes,
+                                   preserve=preserve, max_phys=max_phys,
+                                   grouper=raw_grouper)
+
     def delete(self, key):
         """Delete any existing record filed under `key`.
         """
@@ -745,7 +1939,7 @@ class Collection(object):
             data = self.strategy.pop(txn, key)
             if data:
                 obj = self.encoder.unpack(key, data)
-                dispatch(self._after_delete, key, obj)
+                self._after_delete(key, obj)
         else:
             self.strategy.delete(txn, key)
 
@@ -777,12 +1971,12 @@ class TxnContext(object):
         handled = True
         if exc_type:
             self.local.txn.abort()
-            dispatch(self._after_abort)
+            self._after_abort()
             handled = exc_type is errors.AbortError
         else:
-            dispatch(self._on_commit)
+            self._on_commit()
             self.local.txn.commit()
-            dispatch(self._after_commit)
+            self._after_commit()
         del self.local.txn
         del self.local.write
         return handled
@@ -794,6 +1988,14 @@ class TxnContext(object):
         raise errors.TxnError('Transactions *must* be wrapped in a with: '
                               'block to ensure proper destruction.')
 
+    def swap(self, txn):
+        """Replace the active transaction with `txn`, returning the previous
+        transaction. Used to interpose a wrapper around the engine transaction
+        for a bounded section of code."""
+        old = self.get()
+        self.local.txn = txn
+        return old
+
 
 class GeventTxnContext(TxnContext):
     """Like TxnContext except using gevent.local.local().
@@ -804,6 +2006,476 @@ class GeventTxnContext(TxnContext):
         self.local = gevent.local.local()
 
 
+class UndoTxn(object):
+    """Wraps an engine transaction, recording the prior value of every key
+    mutated through it, so that the mutations can later be reverted without
+    aborting the underlying transaction.
+
+        `txn`:
+            :py:class:`acid.engines.Engine` transaction to wrap.
+    """
+    def __init__(self, txn):
+        self.txn = txn
+        self.source = getattr(txn, 'source', None)
+        self.get = txn.get
+        self.iter = txn.iter
+        #: Map of physical key to its prior value, or ``None`` if the key did
+        #: not previously exist.
+        self.undo = {}
+
+    def _save(self, key):
+        key = bytes(key)
+        if key not in self.undo:
+            old = self.txn.get(key)
+            # Copy, since buffers may be invalidated by the following write.
+            self.undo[key] = None if old is None else bytes(old)
+
+    def put(self, key, value):
+        self._save(key)
+        self.txn.put(key, value)
+
+    def replace(self, key, value):
+        self._save(key)
+        return self.txn.replace(key, value)
+
+    def delete(self, key):
+        self._save(key)
+        self.txn.delete(key)
+
+    def pop(self, key):
+        self._save(key)
+        return self.txn.pop(key)
+
+    def rollback(self):
+        """Restore the prior value of every key mutated through the wrapper.
+        """
+        for key, old in self.undo.iteritems():
+            if old is None:
+                self.txn.delete(key)
+            else:
+                self.txn.put(key, old)
+        self.undo.clear()
+
+
+class WriteBuffer(object):
+    """Wraps an engine transaction, deferring every write until
+    :py:meth:`flush`, where they are applied in key order. Reads via
+    :py:meth:`get` observe deferred writes, however iteration does not.
+
+        `txn`:
+            :py:class:`acid.engines.Engine` transaction to wrap.
+    """
+    def __init__(self, txn):
+        self.txn = txn
+        self.source = getattr(txn, 'source', None)
+        self.iter = txn.iter
+        #: Map of physical key to its new value, or ``None`` if the key is to
+        #: be deleted.
+        self.writes = {}
+
+    def get(self, key):
+        key = bytes(key)
+        if key in self.writes:
+            return self.writes[key]
+        return self.txn.get(key)
+
+    def put(self, key, value):
+        self.writes[bytes(key)] = value
+
+    def replace(self, key, value):
+        old = self.get(key)
+        self.put(key, value)
+        return old
+
+    def delete(self, key):
+        self.writes[bytes(key)] = None
+
+    def pop(self, key):
+        old = self.get(key)
+        self.delete(key)
+        return old
+
+    def flush(self):
+        """Apply all deferred writes to the underlying transaction in key
+        order."""
+        for key in sorted(self.writes):
+            value = self.writes[key]
+            if value is None:
+                self.txn.delete(key)
+            else:
+                self.txn.put(key, value)
+        self.writes.clear()
+
+
+class _GroupSlot(object):
+    """A single closure submitted to :py:class:`GroupCommit`, and the outcome
+    of running it."""
+    done = False
+    result = None
+    exc_info = None
+
+    def __init__(self, func):
+        self.func = func
+        self.event = threading.Event()
+
+    def finish(self):
+        if self.exc_info:
+            raise self.exc_info[0], self.exc_info[1], self.exc_info[2]
+        return self.result
+
+
+class GroupCommit(object):
+    """Execute short write closures submitted from many threads back-to-back
+    within a single engine write transaction, committing them together. On
+    engines that serialize writers and sync once per transaction, like
+    :py:class:`LmdbEngine <acid.engines.LmdbEngine>` and
+    :py:class:`PlyvelEngine <acid.engines.PlyvelEngine>`, this amortizes the
+    writer lock and commit cost over every closure in the group.
+
+    The first thread to submit a closure while no group is running becomes the
+    group's leader, and runs every closure queued when it starts. Remaining
+    threads sleep until their closure's group has committed, and one of them
+    is promoted to lead the next group.
+
+        `store`:
+            :py:class:`Store` to write to.
+
+        `max_group`:
+            Maximum number of closures to run in any single transaction.
+
+    Each closure runs in the leader's thread, with its writes recorded via
+    :py:class:`UndoTxn`. If a closure raises, only its own writes are reverted
+    and the exception is re-raised in the submitting thread, while other
+    members of the group commit normally. In-memory state the closure
+    produced, such as counter ranges reserved by :py:meth:`Store.lease`, is
+    discarded along with its writes, however since the group transaction
+    itself does not abort, :py:func:`after_abort <acid.events.after_abort>`
+    listeners do not fire. If the commit itself fails, or a closure raises an
+    exception not derived from :py:class:`Exception`, such as
+    :py:class:`KeyboardInterrupt`, the group aborts and the exception is
+    raised in every thread of the group.
+
+    ::
+
+        group = acid.core.GroupCommit(store)
+
+        def handle_request(req):
+            return group.submit(lambda: store['hits'].put(req.path))
+    """
+    def __init__(self, store, max_group=64):
+        self.store = store
+        self.max_group = max_group
+        self._lock = threading.Lock()
+        self._queue = []
+        self._busy = False
+
+    def submit(self, func):
+        """Run `func()` as part of the next group transaction, blocking until
+        the group commits. Return the return value of `func()`, or re-raise
+        any exception it raised. If `func` invokes :py:func:`acid.abort`, its
+        writes are discarded and ``None`` is returned.
+        """
+        if self.store._txn_context.mode() is not None:
+            raise errors.TxnError('Transaction already active for this thread')
+
+        slot = _GroupSlot(func)
+        with self._lock:
+            self._queue.append(slot)
+            lead = not self._busy
+            self._busy = True
+        if not lead:
+            slot.event.wait()
+        if not slot.done:
+            # Leader, or promoted to lead after the previous group finished.
+            self._run_group()
+        return slot.finish()
+
+    def _run_slot(self, ctx, txn, slot):
+        undo = UndoTxn(txn)
+        restore = self.store._savepoint()
+        ctx.swap(undo)
+        try:
+            slot.result = slot.func()
+        except errors.AbortError:
+            undo.rollback()
+            restore()
+        except Exception:
+            slot.exc_info = sys.exc_info()
+            undo.rollback()
+            restore()
+        finally:
+            ctx.swap(txn)
+
+    def _run_group(self):
+        with self._lock:
+            group = self._queue[:self.max_group]
+            del self._queue[:self.max_group]
+
+        ctx = self.store._txn_context
+        try:
+            with ctx.begin(write=True):
+                txn = ctx.get()
+                for slot in group:
+                    self._run_slot(ctx, txn, slot)
+        except Exception:
+            exc_info = sys.exc_info()
+            for slot in group:
+                slot.exc_info = slot.exc_info or exc_info
+        except BaseException:
+            # KeyboardInterrupt and friends abort the whole group, and are
+            # re-raised in the leader after waking its followers.
+            exc_info = sys.exc_info()
+            for slot in group:
+                slot.exc_info = slot.exc_info or exc_info
+            raise
+        finally:
+            with self._lock:
+                if self._queue:
+                    # Promote the next waiter to lead the following group.
+                    self._queue[0].event.set()
+                else:
+                    self._busy = False
+
+            for slot in group:
+                slot.done = True
+                slot.event.set()
+
+
+class _CompactorLocal(threading.local):
+    """Per-thread write tracking state for :py:class:`Compactor`."""
+    def __init__(self):
+        #: {collection name: [lo, hi]} written by the current transaction.
+        self.pending = {}
+
+
+class Compactor(object):
+    """Incrementally combine records recently written to batch strategy
+    collections into batch records, so cold data is compressed without
+    manually invoking :py:meth:`Collection.batch`. Work is split into short
+    write transactions visiting a bounded number of physical records, so
+    writers are never blocked for long.
+
+    The range of keys written to each watched collection by every committed
+    transaction is recorded, and overlapping ranges are merged. Once a range
+    has gone unwritten for `min_age` seconds, it is batched over one or more
+    transactions, oldest range first.
+
+        `store`:
+            :py:class:`Store` to compact.
+
+        `max_phys`:
+            Maximum number of physical records visited by any single
+            compaction transaction.
+
+        `min_age`:
+            Seconds a range must go unwritten before it is compacted, leaving
+            recently written, likely hot, records alone.
+
+        `pause`:
+            Seconds to sleep between compaction transactions when running in
+            the background, bounding the share of time writers may wait on the
+            compactor.
+
+        `interval`:
+            Seconds to sleep when running in the background and no range is
+            ready.
+
+    ::
+
+        compactor = acid.core.Compactor(store, min_age=60, pause=0.05)
+        compactor.watch(store['logs'], max_recs=100, max_bytes=16384)
+        compactor.start()
+    """
+    def __init__(self, store, max_phys=200, min_age=0, pause=0,
+                 interval=1.0):
+        self.store = store
+        self.max_phys = max_phys
+        self.min_age = min_age
+        self.pause = pause
+        self.interval = interval
+        self._lock = threading.Lock()
+        self._local = _CompactorLocal()
+        #: {collection name: (Collection, batch() keyword arguments)}
+        self._colls = {}
+        #: {collection name: [[lo, hi, last write time], ..]}
+        self._dirty = {}
+        self._stop = threading.Event()
+        self._thread = None
+        self._passes = 0
+        self._found = 0
+        self._made = 0
+        self._errors = 0
+        store._after_commit.append(self._after_commit)
+        store._after_abort.append(self._after_abort)
+        store._savepoint_hooks.append(self._savepoint)
+
+    def watch(self, coll, max_recs=None, max_bytes=None, grouper=None):
+        """Begin tracking writes to `coll`, compacting them into batches
+        according to `max_recs`, `max_bytes` and `grouper`, as described for
+        :py:meth:`Collection.batch`."""
+        assert max_bytes or max_recs, 'max_bytes and/or max_recs is required.'
+        if not hasattr(coll.strategy, 'batch'):
+            raise TypeError('%r does not support batching' % (coll,))
+        name = coll.info['name']
+        self._colls[name] = (coll, {'max_recs': max_recs,
+                                    'max_bytes': max_bytes,
+                                    'grouper': grouper})
+        coll._after_update.append(lambda key, rec: self._on_update(name, key))
+
+    def _on_update(self, name, key):
+        rng = self._local.pending.get(name)
+        if rng is None:
+            self._local.pending[name] = [key, key]
+        elif key < rng[0]:
+            rng[0] = key
+        elif key > rng[1]:
+            rng[1] = key
+
+    def _after_commit(self):
+        """Respond to after_commit() by recording ranges written by the
+        transaction."""
+        pending = self._local.pending
+        if pending:
+            self._local.pending = {}
+            now = time.time()
+            with self._lock:
+                for name, (lo, hi) in pending.iteritems():
+                    self._add_range(name, lo, hi, now)
+
+    def _after_abort(self):
+        """Respond to after_abort() by discarding ranges written by the
+        transaction."""
+        self._local.pending = {}
+
+    def _savepoint(self):
+        """Store savepoint hook restoring ranges written by the transaction."""
+        local = self._local
+        pending = dict((name, list(rng))
+                       for name, rng in local.pending.iteritems())
+        def restore():
+            local.pending = pending
+        return restore
+
+    def _add_range(self, name, lo, hi, mtime):
+        """Merge `lo..hi` into the dirty ranges of collection `name`."""
+        ranges = []
+        for rng in self._dirty.get(name, ()):
+            if rng[1] < lo or rng[0] > hi:
+                ranges.append(rng)
+            else:
+                lo = min(lo, rng[0])
+                hi = max(hi, rng[1])
+                mtime = max(mtime, rng[2])
+        ranges.append([lo, hi, mtime])
+        ranges.sort()
+        self._dirty[name] = ranges
+
+    def _pop_ready(self):
+        """Remove and return `(name, lo, hi, mtime)` for the least recently
+        written range older than `min_age`, or ``None``."""
+        deadline = time.time() - self.min_age
+        with self._lock:
+            best = None
+            for name, ranges in self._dirty.iteritems():
+                for i, rng in enumerate(ranges):
+                    if rng[2] <= deadline and (best is None or
+                                               rng[2] < best[2][2]):
+                        best = (name, i, rng)
+            if best is None:
+                return None
+            name, i, (lo, hi, mtime) = best
+            del self._dirty[name][i]
+            return name, lo, hi, mtime
+
+    def run_once(self):
+        """Compact part of the oldest ready range in a single transaction.
+        Return ``True`` if a range was ready, or ``False`` if there was
+        nothing to do."""
+        ready = self._pop_ready()
+        if ready is None:
+            return False
+
+        name, lo, hi, mtime = ready
+        coll, kwargs = self._colls[name]
+        try:
+            with self.store.begin(write=True):
+                found, made, last_key = coll.batch(lo=lo, hi=hi,
+                    max_phys=self.max_phys, **kwargs)
+        except Exception:
+            LOG.exception('%r: while compacting %r..%r', coll, lo, hi)
+            with self._lock:
+                self._errors += 1
+                self._add_range(name, lo, hi, time.time())
+            return True
+
+        with self._lock:
+            self._passes += 1
+            self._found += found
+            self._made += made
+            # Stopping short of `hi` means max_phys was reached. Resume from
+            # the last key visited, unless no progress was made.
+            if last_key is not None and lo < last_key < hi:
+                self._add_range(name, last_key, hi, mtime)
+        return True
+
+    def stats(self):
+        """Return a dict describing progress, with keys `passes` (compaction
+        transactions committed), `found` (records combined), `made` (batches
+        written), `errors` (failed transactions), and `pending` (key ranges
+        awaiting compaction)."""
+        with self._lock:
+            return {'passes': self._passes, 'found': self._found,
+                    'made': self._made, 'errors': self._errors,
+                    'pending': sum(len(r) for r in self._dirty.itervalues())}
+
+    def start(self):
+        """Begin compacting in a background thread."""
+        assert self._thread is None, 'already started'
+        self._stop.clear()
+        self._thread = threading.Thread(target=self._run,
+                                        name='acid.core.Compactor')
+        self._thread.daemon = True
+        self._thread.start()
+
+    def stop(self):
+        """Stop the background thread, waiting for any active transaction to
+        finish."""
+        if self._thread:
+            self._stop.set()
+            self._thread.join()
+            self._thread = None
+
+    def _run(self):
+        while not self._stop.is_set():
+            if self.run_once():
+                self._stop.wait(self.pause)
+            else:
+                self._stop.wait(self.interval)
+
+
+class _BatchLocal(threading.local):
+    """Per-thread batch cache state for :py:class:`Store`."""
+    #: :py:class:`acid.iterators.BatchCache` for the current transaction, or
+    #: ``None`` before first use.
+    cache = None
+
+
+class _MetaLocal(threading.local):
+    """Per-thread metadata cache state for :py:class:`Store`."""
+    #: True if the generation counter was checked during this transaction.
+    checked = False
+    #: Generation counter value before the transaction's first update.
+    base = None
+    #: Generation counter value after the transaction's last update.
+    gen = None
+    #: Number of times the transaction incremented the counter.
+    updates = 0
+
+    def __init__(self):
+        #: {(kind, name): dct} written by the current transaction.
+        self.pending = {}
+
+
 class Store(object):
     """Represents access to the underlying storage engine, and manages
     counters.
@@ -818,20 +2490,45 @@ class Store(object):
             Prefix for all keys used by any associated object (record, index,
             counter, metadata). This allows the storage engine's key space to
             be shared amongst several users.
+
+        `batch_cache_size`:
+            Maximum number of decompressed batch payloads retained during a
+            transaction, so that neighbouring reads from one batch decompress
+            it once. The cache is emptied when the transaction ends. ``0``
+            disables caching.
     """
-    def __init__(self, engine, txn_context=None, prefix=''):
+    def __init__(self, engine, txn_context=None, prefix='',
+                 batch_cache_size=64):
         self.engine = engine
         self.prefix = prefix
         self._txn_context = txn_context or TxnContext(engine)
-        self._on_commit = []
-        self._after_commit = []
-        self._after_abort = []
+        self._on_commit = Dispatcher()
+        self._after_commit = Dispatcher()
+        self._after_abort = Dispatcher()
         # TODO HACK
         self._txn_context._on_commit = self._on_commit
         self._txn_context._after_commit = self._after_commit
         self._txn_context._after_abort = self._after_abort
         self.begin = self._txn_context.begin
         self._counter_key_cache = {}
+        self._lease_lock = threading.Lock()
+        self._leases = {}
+        self._after_commit.append(self._lease_after_commit)
+        self._after_abort.append(self._lease_after_abort)
+        # (generation, {(kind, name): dct}), or None before first load.
+        self._meta_cache = None
+        self._meta_local = _MetaLocal()
+        self._after_commit.append(self._meta_after_commit)
+        self._after_abort.append(self._meta_after_abort)
+        self._batch_cache_size = batch_cache_size
+        self._batch_local = _BatchLocal()
+        self._after_commit.append(self._batch_after_txn)
+        self._after_abort.append(self._batch_after_txn)
+        # Functions invoked as `func()` before each GroupCommit closure runs,
+        # returning a function that discards in-memory state the closure
+        # produced should it fail.
+        self._savepoint_hooks = [self._meta_savepoint, self._lease_savepoint,
+                                 lambda: self._batch_after_txn]
         self._encoder_prefix = dict((e, keylib.pack_int(1 + i))
                                     for i, e in enumerate(encoders._ENCODERS))
         self._prefix_encoder = dict((keylib.pack_int(1 + i), e)
@@ -889,23 +2586,134 @@ class Store(object):
             ``acid.core.KIND_COUNTER``
             ``acid.core.KIND_STRUCT``
         """
-        func = lambda: list(self._meta.items(prefix=(kind, name)))
-        return dict((a, v) for (n, k, a,), (v,) in self.in_txn(func))
+        return self.in_txn(lambda: self._get_meta_txn(kind, name))
 
     def set_meta(self, kind, name, dct):
         """Replace the stored metadata for `name` using `dct`."""
         def _set_meta_txn():
+            # Ensure the cache reflects the generation prior to our update.
+            self._check_meta()
             for key in list(self._meta.keys(prefix=(kind, name))):
                 self._meta.delete(key)
             for key, value in dct.iteritems():
                 self._meta.put(value, key=(kind, name, key))
+            local = self._meta_local
+            gen = 1 + self.count('\x00meta_gen', init=0)
+            if not local.pending:
+                local.base = gen - 1
+                local.updates = 0
+            local.pending[kind, name] = dict(dct)
+            local.gen = gen
+            local.updates += 1
         return self.in_txn(_set_meta_txn)
 
-    def get_index_meta(self, name, index_for):
+    def _get_meta_txn(self, kind, name):
+        local = self._meta_local
+        dct = local.pending.get((kind, name))
+        if dct is None:
+            self._check_meta()
+            dct = self._meta_cache[1].get((kind, name), {})
+        return dict(dct)
+
+    def _check_meta(self):
+        """Reload the metadata cache using a single scan if its generation
+        differs from the stored generation counter. The counter is only read
+        once per transaction."""
+        local = self._meta_local
+        if local.checked:
+            return
+        gen = self.count('\x00meta_gen', n=0, init=0)
+        cache = self._meta_cache
+        if cache is None or cache[0] != gen:
+            dct = {}
+            # Skip counters, which change too frequently to cache.
+            it = itertools.chain(self._meta.items(hi=(KIND_COUNTER,)),
+                                 self._meta.items(lo=(KIND_COUNTER + 1,)))
+            for (kind, name, attr), (value,) in it:
+                dct.setdefault((kind, name), {})[attr] = value
+            self._meta_cache = (gen, dct)
+        local.checked = True
+
+    def _meta_after_commit(self):
+        """Respond to after_commit() by merging metadata written by the
+        transaction into the cache, and rechecking the generation counter
+        during the next transaction."""
+        local = self._meta_local
+        if local.pending:
+            cache = self._meta_cache
+            # Merge only if no other transaction updated the counter.
+            if cache and cache[0] == local.base \
+                    and local.gen - local.base == local.updates:
+                dct = cache[1].copy()
+                dct.update(local.pending)
+                self._meta_cache = (local.gen, dct)
+            else:
+                self._meta_cache = None
+            local.pending = {}
+        local.checked = False
+
+    def _savepoint(self):
+        """Return a function that discards in-memory state produced by the
+        calling thread's transaction since this call, used when a single
+        :py:class:`GroupCommit` closure fails while its group commits."""
+        restores = [hook() for hook in self._savepoint_hooks]
+        def restore():
+            for func in restores:
+                func()
+        return restore
+
+    def _meta_savepoint(self):
+        """Savepoint hook restoring metadata written by the transaction."""
+        local = self._meta_local
+        pending = dict(local.pending)
+        state = local.base, local.gen, local.updates
+        def restore():
+            local.pending = pending
+            local.base, local.gen, local.updates = state
+        return restore
+
+    def _meta_after_abort(self):
+        """Respond to after_abort() by discarding metadata written by the
+        transaction."""
+        local = self._meta_local
+        local.pending = {}
+        local.checked = False
+
+    def _batch_cache(self):
+        """Return the calling thread's :py:class:`acid.iterators.BatchCache`,
+        or ``None`` if caching is disabled."""
+        local = self._batch_local
+        if local.cache is None and self._batch_cache_size:
+            local.cache = iterators.BatchCache(self._batch_cache_size)
+        return local.cache
+
+    def _batch_after_txn(self):
+        """Respond to after_commit() and after_abort() by emptying the batch
+        cache, since other transactions may since have rewritten its
+        batches."""
+        cache = self._batch_local.cache
+        if cache is not None:
+            cache.clear()
+
+    def batch_cache_stats(self):
+        """Return a dict describing the calling thread's batch cache, with
+        keys `hits` and `misses` counting lookups since the thread first used
+        the cache, and `size` giving the number of entries currently held."""
+        cache = self._batch_local.cache
+        if cache is None:
+            return {'hits': 0, 'misses': 0, 'size': 0}
+        return {'hits': cache.hits, 'misses': cache.misses,
+                'size': len(cache)}
+
+    def get_index_meta(self, name, index_for, ready=lambda: True):
+        """Return metadata for the index `name`, creating it if it does not
+        exist. A new index is marked ready for use only if `ready()` returns
+        ``True``."""
         dct = self.get_meta(KIND_INDEX, name)
         if not dct:
             idx = self.count('\x00collections_idx', init=10)
-            dct = {'name': name, 'idx': idx, 'index_for': index_for}
+            dct = {'name': name, 'idx': idx, 'index_for': index_for,
+                   'ready': self.in_txn(ready)}
             self.set_meta(KIND_INDEX, name, dct)
         return dct
 
@@ -920,16 +2728,45 @@ class Store(object):
         info['name'] = new
 
     def add_collection(self, name, **kwargs):
-        """Shorthand for `acid.Collection(self, **kwargs)`."""
+        """Shorthand for `acid.Collection(self, **kwargs)`. Additionally
+        accepts:
+
+            `strategy`:
+                Physical record format, persisted on creation. ``"batch"``
+                (the default) stores batch records whose value is compressed
+                as a whole, while ``"batch3"`` stores batch records made from
+                independently compressed blocks, allowing any record to be
+                read by decompressing only its block. ``"columnar"`` stores
+                each field of a batch contiguously, and requires an encoder
+                from :py:func:`acid.encoders.make_struct_encoder`.
+
+            `max_recs`, `max_bytes`:
+                Limits for batches grown by inserts, persisted on creation
+                and used by every :py:class:`Collection` that does not
+                override them.
+        """
         old = self.get_meta(KIND_TABLE, name)
         encoder = kwargs.get('encoder', encoders.JSON)
         new = {'name': name, 'encoder': encoder.name}
+        strategy = kwargs.pop('strategy', None)
+        if strategy is not None:
+            new['strategy'] = strategy
+        for key in 'max_recs', 'max_bytes':
+            if kwargs.get(key) is not None:
+                new[key] = kwargs[key]
         if old:
+            old.setdefault('strategy', 'batch')
             for key, value in old.iteritems():
                 if new.setdefault(key, value) != value:
                     raise errors.ConfigError('attribute %r: %r != %r' %\
                                              (key, value, new[key]))
         else:
+            # Checked again by Collection, but only after the metadata would
+            # have been written.
+            if new.get('strategy') == 'columnar' and \
+                    getattr(encoder, 'struct_type', None) is None:
+                raise errors.ConfigError('columnar strategy requires an '
+                                         'encoder from make_struct_encoder()')
             new['idx'] = self.count('\x00collections_idx', init=10)
             self.set_meta(KIND_TABLE, name, new)
         return self.__getitem__(name, kwargs)
@@ -946,7 +2783,10 @@ class Store(object):
 
     def add_encoder(self, encoder):
         """Register an :py:class:`acid.encoders.Encoder` so that
-        :py:class:`Collection` can find it during decompression/unpacking."""
+        :py:class:`Collection` can find it during decompression/unpacking. Any
+        dictionaries trained for an :py:class:`acid.encoders.DictCompressor`
+        are loaded into it, and dictionaries trained later by other processes
+        are loaded when first needed."""
         try:
             return self._encoder_prefix[encoder]
         except KeyError:
@@ -956,18 +2796,81 @@ class Store(object):
                 idx = self.count('\x00encoder_idx', init=10)
                 assert idx <= 240
                 self.set_meta(KIND_ENCODER, encoder.name, {'idx': idx})
+            if isinstance(encoder, encoders.DictCompressor):
+                self._load_dicts(encoder)
+                encoder.loaders.append(self._load_dicts)
             self._encoder_prefix[encoder] = keylib.pack_int(idx)
             self._prefix_encoder[keylib.pack_int(idx)] = encoder
             return self._encoder_prefix[encoder]
 
+    def _load_dicts(self, compressor):
+        """Add dictionaries trained for the
+        :py:class:`acid.encoders.DictCompressor` `compressor` newer than its
+        current version, reading them via the metadata cache."""
+        dct = self.get_meta(KIND_ENCODER, compressor.name)
+        for version in xrange(1 + compressor.version,
+                              1 + dct.get('dict_version', 0)):
+            compressor.add_dict(version, dct['dict_%d' % version])
+
+    def train_compressor(self, compressor, coll, samples=1000, size=16384):
+        """Train a new dictionary for the
+        :py:class:`acid.encoders.DictCompressor` `compressor` from a random
+        sample of up to `samples` encoded records of the :py:class:`Collection`
+        `coll`, limiting the dictionary to `size` bytes. The dictionary is
+        saved in the store's metadata as the compressor's next version, and
+        the version is returned.
+
+        Batches written afterwards use the new dictionary, while existing
+        batches remain readable using the version they were written with.
+        Since every version is retained, retraining should be infrequent. Note
+        `compressor` must be registered using :py:meth:`add_encoder` in every
+        process that reads the collection.
+
+        Existing batches are read using `coll`'s own compressor, so it must
+        be the compressor they were written with, which need not be
+        `compressor`. Sampling runs in a read transaction, and a write
+        transaction is only held to save the dictionary."""
+        rand = random.Random()
+        sample = []
+        def _sample_txn():
+            it = coll.strategy.iter(self._txn_context.get())
+            for i, res in enumerate(it.forward()):
+                if i < samples:
+                    sample.append(bytes(res.data))
+                else:
+                    j = rand.randint(0, i)
+                    if j < samples:
+                        sample[j] = bytes(res.data)
+
+        self.in_txn(_sample_txn)
+        zdict = encoders.train_dict(sample, size)
+
+        def _save_txn():
+            self.add_encoder(compressor)
+            dct = self.get_meta(KIND_ENCODER, compressor.name)
+            version = 1 + dct.get('dict_version', 0)
+            dct['dict_version'] = version
+            dct['dict_%d' % version] = zdict
+            self.set_meta(KIND_ENCODER, compressor.name, dct)
+            return version
+
+        # Only use the dictionary once it is certain to have been saved.
+        version = self.in_txn(_save_txn, write=True)
+        compressor.add_dict(version, zdict)
+        return version
+
     def get_encoder(self, prefix):
         """Get a registered :py:class:`acid.encoders.Encoder` given its string
         prefix, or raise an error."""
         try:
             return self._prefix_encoder[prefix]
         except KeyError:
-            it = self._meta.items(prefix=KIND_ENCODER)
-            dct = dict((v, n) for (k, n, a), v in it if a == 'idx')
+            def _get_names():
+                self._check_meta()
+                return dict((dct.get('idx'), name)
+                            for (kind, name), dct in self._meta_cache[1].items()
+                            if kind == KIND_ENCODER)
+            dct = self.in_txn(_get_names)
             idx = keylib.unpack_int(prefix)
             raise errors.ConfigError('Missing encoder: %r / %d' %\
                                      (dct.get(idx), idx))
@@ -997,3 +2900,74 @@ class Store(object):
         if n:
             self._meta.put(value + n, key=key)
         return 0L + value
+
+    def lease(self, name, block, init=1):
+        """Like :py:meth:`count`, except values are handed out from an
+        in-memory range of `block` values, reserved using a single counter
+        update each time the range is exhausted. The counter always reflects
+        the high-water mark of every range reserved by any process, so values
+        are never repeated, but values unused when the process exits are
+        skipped.
+
+        If the transaction that reserved a range aborts, the range is
+        discarded, since the counter update it was reserved with was also
+        discarded.
+
+            `name`:
+                Name of the counter.
+
+            `block`:
+                Number of values to reserve at a time.
+
+            `init`:
+                Initial value to give counter if it doesn't exist.
+        """
+        with self._lease_lock:
+            lease = self._leases.get(name)
+            if lease is None or lease[0] == lease[1]:
+                start = self.count(name, n=block, init=init)
+                # [next value, end of range, committed?]
+                lease = [start, start + block, False]
+                self._leases[name] = lease
+            value = lease[0]
+            lease[0] += 1
+            return value
+
+    def _lease_after_commit(self):
+        """Respond to after_commit() by marking every range reserved by the
+        transaction as durable."""
+        # Read transactions cannot have reserved a range.
+        if not self._txn_context.mode():
+            return
+        with self._lease_lock:
+            for lease in self._leases.itervalues():
+                lease[2] = True
+
+    def _lease_savepoint(self):
+        """Savepoint hook discarding ranges reserved since the savepoint."""
+        with self._lease_lock:
+            saved = dict(self._leases)
+        def restore():
+            with self._lease_lock:
+                for name, lease in self._leases.items():
+                    if not (lease[2] or saved.get(name) is lease):
+                        del self._leases[name]
+        return restore
+
+    def _lease_after_abort(self):
+        """Respond to after_abort() by discarding every range reserved by the
+        transaction."""
+        # Ranges reserved by a concurrent write transaction must survive.
+        if not self._txn_context.mode():
+            return
+        with self._lease_lock:
+            for name, lease in self._leases.items():
+                if not lease[2]:
+                    del self._leases[name]
+
+
+if acid._use_speedups:
+    try:
+        from acid._core import Dispatcher
+    except ImportError:
+        pass
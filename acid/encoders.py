@@ -15,6 +15,7 @@
 #
 
 from __future__ import absolute_import
+import collections
 import functools
 import operator
 import zlib
@@ -25,10 +26,12 @@ except ImportError:
     import StringIO
 
 import acid
+import acid.errors
 import acid.keylib
 
-__all__ = ['RecordEncoder', 'make_json_encoder', 'make_msgpack_encoder',
-           'make_thrift_encoder']
+__all__ = ['RecordEncoder', 'DictCompressor', 'make_json_encoder',
+           'make_msgpack_encoder', 'make_struct_encoder',
+           'make_thrift_encoder', 'train_dict']
 
 
 class RecordEncoder(object):
@@ -111,16 +114,397 @@ class Compressor(object):
             then first convert it using :py:func:`str`. The function may return
             :py:func:`str` or any object supporting the :py:func:`buffer`
             interface.
+
+        `stream`:
+            Optional function invoked as `func()` to create a streaming
+            compressor, used to cheaply estimate the compressed size of a
+            growing batch. The returned object must have a `compress(data)`
+            method that returns any output produced so far, and a `flush()`
+            method that returns all pending output without ending the stream.
     """
-    def __init__(self, name, unpack, pack):
+    def __init__(self, name, unpack, pack, stream=None):
         self.name = name
         self.unpack = unpack
         self.pack = pack
+        self.stream = stream
 
     def __repr__(self):
         klass = self.__class__
         return '<%s.%s %r>' % (klass.__module__, klass.__name__, self.name)
 
+
+class _ZlibStream(object):
+    """Streaming compressor for :py:attr:`ZLIB`."""
+    def __init__(self):
+        self._obj = zlib.compressobj()
+        self.compress = self._obj.compress
+
+    def flush(self):
+        return self._obj.flush(zlib.Z_SYNC_FLUSH)
+
+
+class _DictStream(object):
+    """Streaming compressor for :py:class:`DictCompressor`."""
+    def __init__(self, obj):
+        self._obj = obj
+        self.compress = obj.compress
+
+    def flush(self):
+        return self._obj.flush(zlib.Z_SYNC_FLUSH)
+
+
+class DictCompressor(Compressor):
+    """A :py:class:`Compressor` using zlib with a preset dictionary, allowing
+    small records to be compressed using strings common to the whole
+    collection, rather than only those repeated within a single batch.
+
+    Dictionaries are identified by an integer version, and each compressed
+    value is prefixed by the version of the dictionary used to produce it, so
+    that values remain readable after retraining. Version ``0`` is the empty
+    dictionary, used until one is trained. New values are always compressed
+    using the highest version.
+
+    Dictionaries are usually trained using :py:meth:`Store.train_compressor
+    <acid.Store.train_compressor>`, which persists them in the store's
+    metadata. They are reloaded when the compressor is registered using
+    :py:meth:`Store.add_encoder <acid.Store.add_encoder>`.
+
+        `name`:
+            ASCII string uniquely identifying the compressor.
+
+        `level`:
+            zlib compression level.
+    """
+    def __init__(self, name, level=6):
+        Compressor.__init__(self, name, self._unpack, self._pack,
+                            self._stream)
+        self.level = level
+        #: Highest dictionary version added.
+        self.version = 0
+        #: {version: (dictionary, primed compressobj, primed decompressobj)}
+        self._dicts = {}
+        #: Functions invoked as `func(compressor)` to load dictionaries found
+        #: missing during decompression, such as those trained by another
+        #: process. :py:meth:`acid.Store.add_encoder` registers one.
+        self.loaders = []
+        self.add_dict(0, '')
+
+    def add_dict(self, version, zdict):
+        """Make the bytestring `zdict` available as dictionary `version`."""
+        # zlib in Python 2 lacks preset dictionary support, so prime raw
+        # deflate streams with the dictionary instead, then copy them for
+        # each value. Later output may refer back into the dictionary exactly
+        # as if it were preset.
+        cobj = zlib.compressobj(self.level, zlib.DEFLATED, -15)
+        primer = cobj.compress(zdict) + cobj.flush(zlib.Z_SYNC_FLUSH)
+        dobj = zlib.decompressobj(-15)
+        dobj.decompress(primer)
+        self._dicts[version] = (zdict, cobj, dobj)
+        self.version = max(self.version, version)
+
+    def get_dict(self, version):
+        """Return the bytestring dictionary `version`."""
+        return self._dicts[version][0]
+
+    def _pack(self, data):
+        cobj = self._dicts[self.version][1].copy()
+        out = bytearray(acid.keylib.pack_int(self.version))
+        out.extend(cobj.compress(data))
+        out.extend(cobj.flush())
+        return bytes(out)
+
+    def _unpack(self, data):
+        ba = bytearray(buffer(data, 0, 9))
+        version, pos = acid.keylib.read_int(ba, 0, len(ba), 0)
+        entry = self._dicts.get(version)
+        if entry is None:
+            for loader in self.loaders:
+                loader(self)
+            entry = self._dicts.get(version)
+            if entry is None:
+                raise acid.errors.ConfigError('%r: missing dictionary '
+                                              'version %d'
+                                              % (self.name, version))
+        dobj = entry[2].copy()
+        return dobj.decompress(buffer(data, pos)) + dobj.flush()
+
+    def _stream(self):
+        return _DictStream(self._dicts[self.version][1].copy())
+
+
+def train_dict(samples, size=16384, seg_len=8):
+    """Return a dictionary of at most `size` bytes for use with
+    :py:class:`DictCompressor`, built from `seg_len`-byte substrings occurring
+    in more than one of the bytestrings `samples`. The most common substrings
+    are placed at the end of the dictionary, where they are cheapest to refer
+    to."""
+    counts = collections.Counter()
+    for sample in samples:
+        sample = str(sample)
+        end = max(1, len(sample) - seg_len + 1)
+        counts.update(set(sample[i:i+seg_len] for i in xrange(end)))
+
+    segs = []
+    total = 0
+    for seg, count in counts.most_common():
+        if count < 2 or (total + len(seg)) > size:
+            break
+        segs.append(seg)
+        total += len(seg)
+    segs.reverse()
+    return ''.join(segs)
+
+
+#: Most output bytes a single byte of LZ4 or Snappy input can produce.
+_LZ4_MAX_EXPANSION = 255
+_SNAPPY_MAX_EXPANSION = 22
+
+
+def _write_varint(v, out):
+    """Append `v` to the bytearray `out` as an unsigned little endian base 128
+    varint, as used by the Snappy and LZ4 formats."""
+    while v >= 0x80:
+        out.append((v & 0x7f) | 0x80)
+        v >>= 7
+    out.append(v)
+
+
+def _read_varint(ba):
+    """Return `(value, pos)` for the varint at the start of the bytearray
+    `ba`."""
+    v = 0
+    for pos, c in enumerate(ba[:10]):
+        v |= (c & 0x7f) << (7 * pos)
+        if not (c & 0x80):
+            return v, pos + 1
+    raise ValueError('corrupt varint.')
+
+
+def _find_matches(data, max_start):
+    """Yield `(pos, offset, length)` for each match found by a greedy scan of
+    the bytestring `data`, considering matches starting before `max_start`
+    and at most 65535 bytes distant."""
+    table = {}
+    pos = 0
+    length = len(data)
+    while pos < max_start:
+        seq = data[pos:pos+4]
+        cand = table.get(seq)
+        table[seq] = pos
+        if cand is not None and (pos - cand) <= 65535:
+            mlen = 4
+            while (pos + mlen) < length and data[cand+mlen] == data[pos+mlen]:
+                mlen += 1
+            yield pos, pos - cand, mlen
+            pos += mlen
+        else:
+            pos += 1
+
+
+def _copy_match(out, offset, length):
+    """Append `length` bytes starting `offset` bytes from the end of the
+    bytearray `out`, which may overlap the bytes being appended."""
+    if not (0 < offset <= len(out)):
+        raise ValueError('corrupt match offset.')
+    start = len(out) - offset
+    if offset >= length:
+        out.extend(out[start:start+length])
+    else:
+        for i in xrange(length):
+            out.append(out[start + i])
+
+
+def lz4_compress(data):
+    """Compress the bytestring `data` to an LZ4 block, prefixed by its
+    uncompressed length as a little endian base 128 varint."""
+    data = str(data)
+    out = bytearray()
+    _write_varint(len(data), out)
+
+    def write_len(n):
+        while n >= 255:
+            out.append(255)
+            n -= 255
+        out.append(n)
+
+    def write_seq(lit_end, offset, mlen):
+        lit_len = lit_end - lit
+        out.append((min(lit_len, 15) << 4) | min(max(0, mlen - 4), 15))
+        if lit_len >= 15:
+            write_len(lit_len - 15)
+        out.extend(data[lit:lit_end])
+        if mlen:
+            out.append(offset & 0xff)
+            out.append(offset >> 8)
+            if (mlen - 4) >= 15:
+                write_len(mlen - 19)
+
+    lit = 0
+    # The final match must start 12 bytes and end 5 bytes before the end.
+    last = len(data) - 5
+    for pos, offset, mlen in _find_matches(data[:last], len(data) - 12):
+        write_seq(pos, offset, mlen)
+        lit = pos + mlen
+    write_seq(len(data), 0, 0)
+    return bytes(out)
+
+
+def lz4_decompress(data):
+    """Decompress a value produced by :py:func:`lz4_compress`."""
+    ba = bytearray(data)
+    size, pos = _read_varint(ba)
+    end = len(ba)
+    if size > (_LZ4_MAX_EXPANSION * (end - pos)):
+        raise ValueError('corrupt LZ4 input.')
+    out = bytearray()
+
+    def read_len(n, pos):
+        while True:
+            c = ba[pos]
+            pos += 1
+            n += c
+            if c != 255:
+                return n, pos
+
+    try:
+        while pos < end:
+            token = ba[pos]
+            pos += 1
+            lit_len = token >> 4
+            if lit_len == 15:
+                lit_len, pos = read_len(lit_len, pos)
+            if (pos + lit_len) > end:
+                raise ValueError
+            out.extend(ba[pos:pos+lit_len])
+            pos += lit_len
+            if pos == end:
+                break
+            offset = ba[pos] | (ba[pos+1] << 8)
+            pos += 2
+            mlen = token & 15
+            if mlen == 15:
+                mlen, pos = read_len(mlen, pos)
+            _copy_match(out, offset, mlen + 4)
+    except (IndexError, ValueError):
+        raise ValueError('corrupt LZ4 input.')
+    if len(out) != size:
+        raise ValueError('corrupt LZ4 input.')
+    return bytes(out)
+
+
+def snappy_compress(data):
+    """Compress the bytestring `data` using the Snappy raw format."""
+    data = str(data)
+    out = bytearray()
+    _write_varint(len(data), out)
+
+    def write_literal(start, end):
+        n = end - start - 1
+        if n < 60:
+            out.append(n << 2)
+        else:
+            count = (n.bit_length() + 7) // 8
+            out.append((59 + count) << 2)
+            for i in xrange(count):
+                out.append((n >> (8 * i)) & 0xff)
+        out.extend(data[start:end])
+
+    def write_copy(offset, length):
+        while length >= 68:
+            out.extend((254, offset & 0xff, offset >> 8))
+            length -= 64
+        if length > 64:
+            out.extend((238, offset & 0xff, offset >> 8))
+            length -= 60
+        if length < 12 and offset < 2048:
+            out.append(((offset >> 8) << 5) | ((length - 4) << 2) | 1)
+            out.append(offset & 0xff)
+        else:
+            out.extend((((length - 1) << 2) | 2, offset & 0xff, offset >> 8))
+
+    lit = 0
+    for pos, offset, mlen in _find_matches(data, len(data) - 4):
+        if pos > lit:
+            write_literal(lit, pos)
+        write_copy(offset, mlen)
+        lit = pos + mlen
+    if len(data) > lit:
+        write_literal(lit, len(data))
+    return bytes(out)
+
+
+def snappy_decompress(data):
+    """Decompress a value produced by :py:func:`snappy_compress`."""
+    ba = bytearray(data)
+    size, pos = _read_varint(ba)
+    end = len(ba)
+    if size > (_SNAPPY_MAX_EXPANSION * (end - pos)):
+        raise ValueError('corrupt Snappy input.')
+    out = bytearray()
+
+    try:
+        while pos < end:
+            tag = ba[pos]
+            pos += 1
+            kind = tag & 3
+            if kind == 0:
+                length = tag >> 2
+                if length >= 60:
+                    count = length - 59
+                    length = 0
+                    for i in xrange(count):
+                        length |= ba[pos + i] << (8 * i)
+                    pos += count
+                length += 1
+                if (pos + length) > end:
+                    raise ValueError
+                out.extend(ba[pos:pos+length])
+                pos += length
+                continue
+            elif kind == 1:
+                length = 4 + ((tag >> 2) & 7)
+                offset = ((tag >> 5) << 8) | ba[pos]
+                pos += 1
+            elif kind == 2:
+                length = 1 + (tag >> 2)
+                offset = ba[pos] | (ba[pos+1] << 8)
+                pos += 2
+            else:
+                length = 1 + (tag >> 2)
+                offset = (ba[pos] | (ba[pos+1] << 8) | (ba[pos+2] << 16) |
+                          (ba[pos+3] << 24))
+                pos += 4
+            _copy_match(out, offset, length)
+    except (IndexError, ValueError):
+        raise ValueError('corrupt Snappy input.')
+    if len(out) != size:
+        raise ValueError('corrupt Snappy input.')
+    return bytes(out)
+
+
+if acid._use_speedups:
+    try:
+        from acid._encoders import lz4_compress
+        from acid._encoders import lz4_decompress
+        from acid._encoders import snappy_compress
+        from acid._encoders import snappy_decompress
+    except ImportError:
+        pass
+
+
+def _buffer_unpack(loads, probe):
+    """Return a :py:class:`RecordEncoder` `unpack` function calling `loads`.
+    Buffers are passed to `loads` directly if it decodes ``buffer(probe)``
+    like the bytestring `probe`, otherwise they are first copied."""
+    try:
+        direct = loads(buffer(probe)) == loads(probe)
+    except Exception:
+        direct = False
+    if direct:
+        return lambda key, data: loads(data)
+    return lambda key, data: loads(bytes(data))
+
+
 def make_json_encoder(separators=',:', **kwargs):
     """Return a :py:class:`RecordEncoder` that serializes
     dict/list/string/float/int/bool/None objects using the :py:mod:`json`
@@ -129,6 +513,8 @@ def make_json_encoder(separators=',:', **kwargs):
 
     The `ujson <https://pypi.python.org/pypi/ujson>`_ package will be used for
     decoding if it is available, otherwise :py:func:`json.loads` is used.
+    Records are decoded directly from engine buffers if the decoder accepts
+    them, otherwise they are copied first.
 
     .. warning::
 
@@ -156,7 +542,7 @@ def make_json_encoder(separators=',:', **kwargs):
     except ImportError:
         decoder = json.JSONDecoder().decode
 
-    decode = lambda key, data: decoder(bytes(data))
+    decode = _buffer_unpack(decoder, '{"a":[1]}')
     return RecordEncoder('json', decode, encoder.encode)
 
 
@@ -164,9 +550,11 @@ def make_msgpack_encoder():
     """Return a :py:class:`RecordEncoder` that serializes
     dict/list/string/float/int/bool/None objects using `MessagePack
     <http://msgpack.org/>`_ via the `msgpack-python
-    <https://pypi.python.org/pypi/msgpack-python/>`_ package."""
+    <https://pypi.python.org/pypi/msgpack-python/>`_ package. Records are
+    decoded directly from engine buffers if the installed version accepts
+    them, otherwise they are copied first."""
     import msgpack
-    unpack = lambda key, data: msgpack.loads(data)
+    unpack = _buffer_unpack(msgpack.loads, msgpack.dumps({'a': [1]}))
     return RecordEncoder('msgpack', unpack, msgpack.dumps)
 
 
@@ -225,6 +613,21 @@ def make_pickle_encoder(protocol=2):
                          functools.partial(cPickle.dumps, protocol=protocol))
 
 
+def make_struct_encoder(struct_type):
+    """Return a :py:class:`RecordEncoder` that serializes
+    :py:class:`acid.structlib.Struct` instances of the
+    :py:class:`acid.structlib.StructType` `struct_type`. The encoder's
+    `struct_type` attribute allows collections using the ``"columnar"``
+    strategy to store each field of a batch contiguously.
+    """
+    unpack = lambda key, data: struct_type.from_raw(bytes(data))
+    encoder = RecordEncoder('struct', unpack, struct_type.to_raw,
+                            new=struct_type.new, get=getattr, set=setattr,
+                            delete=delattr)
+    encoder.struct_type = struct_type
+    return encoder
+
+
 #: Encode Python tuples using keylib.packs()/keylib.unpacks().
 KEY = RecordEncoder('key', lambda key, value: acid.keylib.unpack(value),
                     acid.keylib.packs)
@@ -236,8 +639,14 @@ JSON = make_json_encoder()
 PLAIN = Compressor('plain', str, lambda o: o)
 
 #: Compress bytestrings using zlib.compress()/zlib.decompress().
-ZLIB = Compressor('zlib', zlib.decompress, zlib.compress)
+ZLIB = Compressor('zlib', zlib.decompress, zlib.compress, _ZlibStream)
+
+#: Compress bytestrings using the LZ4 block format.
+LZ4 = Compressor('lz4', lz4_decompress, lz4_compress)
+
+#: Compress bytestrings using the Snappy raw format.
+SNAPPY = Compressor('snappy', snappy_decompress, snappy_compress)
 
 # The order of this tuple is significant. See core.Store source/data format
 # documentation for more information.
-_ENCODERS = (KEY, JSON, PLAIN, ZLIB)
+_ENCODERS = (KEY, JSON, PLAIN, ZLIB, LZ4, SNAPPY)
@@ -45,6 +45,11 @@ class ConstraintError(Error):
         self.name = name
 
 
+class UniqueError(ConstraintError):
+    """Attempt to write a record whose index tuple is already in use by
+    another record in a unique index. :py:attr:`name` is the index name."""
+
+
 class EngineError(Error):
     """Unspecified error occurred with the database engine. The original
     exception may be available as the :py:attr:`inner` attribute."""
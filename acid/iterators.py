@@ -19,10 +19,12 @@ Iterator implementations.
 """
 
 from __future__ import absolute_import
+import collections
 import struct
 
 import acid
 from acid import keylib
+from acid import structlib
 
 
 def decode_offsets(s):
@@ -213,6 +215,57 @@ class BasicIterator(Iterator):
             go = self._step()
 
 
+class BatchCache(object):
+    """Bounded least recently used mapping of decompressed batch payloads,
+    shared by batch iterators reading the same transaction. Entries are keyed
+    by `(phys_key, part)`, where `part` identifies a block within the batch,
+    or is ``None`` when the whole batch is decompressed at once.
+
+        `size`:
+            Maximum number of entries retained.
+    """
+    def __init__(self, size=64):
+        self.size = size
+        #: Number of lookups that found an entry.
+        self.hits = 0
+        #: Number of lookups that found no entry.
+        self.misses = 0
+        self._entries = collections.OrderedDict()
+
+    def __len__(self):
+        return len(self._entries)
+
+    def get(self, phys_key, part=None):
+        """Return the payload cached for `part` of the batch at `phys_key`,
+        or ``None``."""
+        key = (phys_key, part)
+        value = self._entries.pop(key, None)
+        if value is None:
+            self.misses += 1
+        else:
+            self.hits += 1
+            self._entries[key] = value
+        return value
+
+    def put(self, phys_key, part, value):
+        """Cache `value` as the payload for `part` of the batch at
+        `phys_key`, evicting the least recently used entry if full."""
+        self._entries.pop((phys_key, part), None)
+        if len(self._entries) >= self.size:
+            self._entries.popitem(last=False)
+        self._entries[phys_key, part] = value
+
+    def discard(self, phys_key):
+        """Remove every entry for the batch at `phys_key`, following its
+        deletion or replacement."""
+        for key in [k for k in self._entries if k[0] == phys_key]:
+            del self._entries[key]
+
+    def clear(self):
+        """Remove all entries, leaving the counters intact."""
+        self._entries.clear()
+
+
 class BatchIterator(Iterator):
     """Provides bidirectional iteration of a range of keys, treating >1-length
     keys as batch records.
@@ -226,6 +279,10 @@ class BatchIterator(Iterator):
         `compressor`:
             :py:class:`acid.encoders.Compressor` instance used to decompress
             batch keys.
+
+        `cache`:
+            If not ``None``, a :py:class:`BatchCache` consulted before
+            decompressing a batch, and updated afterwards.
     """
     _max_phys = -1
     #: The current key's index into the batch.
@@ -240,10 +297,23 @@ class BatchIterator(Iterator):
     data = None
     _reverse = None
 
-    def __init__(self, engine, prefix, compressor):
+    def __init__(self, engine, prefix, compressor, cache=None):
         self.engine = engine
         self.prefix = prefix
         self.compressor = compressor
+        self.cache = cache
+
+    def _unpack(self, raw, part=None):
+        """Return the decompressed form of `raw`, which is `part` of the
+        current batch, using :py:attr:`cache` if one was given."""
+        if self.cache is None:
+            return self.compressor.unpack(raw)
+        phys_key = bytes(self.phys_key)
+        data = self.cache.get(phys_key, part)
+        if data is None:
+            data = bytes(self.compressor.unpack(raw))
+            self.cache.put(phys_key, part, data)
+        return data
 
     def set_max_phys(self, max_phys):
         """Set the maximum number of physical records to visit."""
@@ -282,7 +352,7 @@ class BatchIterator(Iterator):
             # Decode the array of logical record offsets and save it, along
             # with the decompressed concatenation of all records.
             self._offsets, dstart = decode_offsets(self.raw)
-            self.concat = self.compressor.unpack(buffer(self.raw, dstart))
+            self.concat = self._unpack(buffer(self.raw, dstart))
             self._index = lenk
 
         self._index -= 1
@@ -388,6 +458,12 @@ class BatchV2Iterator(BatchIterator):
     #: Raw bytestring/buffer physical key for the current batch, or ``None``.
     phys_key = None
 
+    def _load_batch(self):
+        """Decode the array of logical record offsets and save it, along with
+        the decompressed concatenation of all records."""
+        self._uncompressed = self._unpack(self.raw)
+        self._key_count, = struct.unpack('>H', self._uncompressed[:2])
+
     def _load_item(self, index):
         pos = 2 + (2*index)
         start, end = struct.unpack('>HH', self._uncompressed[pos:pos+4])
@@ -426,10 +502,7 @@ class BatchV2Iterator(BatchIterator):
                 self._index = 0
                 return True
 
-            # Decode the array of logical record offsets and save it, along
-            # with the decompressed concatenation of all records.
-            self._uncompressed = self.compressor.unpack(self.raw)
-            self._key_count, = struct.unpack('>H', self._uncompressed[:2])
+            self._load_batch()
             self._index = self._key_count
 
             s1 = self.keys[0].to_raw()
@@ -452,6 +525,412 @@ class BatchV2Iterator(BatchIterator):
             yield self.key, self.data
 
 
+class BatchV2Builder(object):
+    """Incrementally accumulates the members of a batch record in the format
+    read by :py:class:`BatchV2Iterator`. Members must be appended in key
+    order. The encoded size is maintained as members are appended, so it may
+    be tested after each append without re-encoding the batch.
+    """
+    def __init__(self):
+        self._keys = []
+        self._raws = []
+        self._values = []
+        #: Total length of raw keys and values.
+        self._data_len = 0
+        #: Length of the prefix shared by the first and last key.
+        self._cp_len = 0
+
+    def __len__(self):
+        return len(self._keys)
+
+    def append(self, key, value):
+        """Append a member with the :py:class:`acid.keylib.Key` `key` and
+        bytestring or buffer `value`."""
+        key = keylib.Key(key)
+        raw = key.to_raw()
+        value = bytes(value)
+        self._keys.append(key)
+        self._raws.append(raw)
+        self._values.append(value)
+        self._data_len += len(raw) + len(value)
+        self._cp_len = common_prefix_len(self._raws[0], raw)
+
+    def pop(self):
+        """Remove the most recently appended member."""
+        self._keys.pop()
+        raw = self._raws.pop()
+        self._data_len -= len(raw) + len(self._values.pop())
+        if self._raws:
+            self._cp_len = common_prefix_len(self._raws[0], self._raws[-1])
+
+    def clear(self):
+        """Remove all members."""
+        self.__init__()
+
+    def keys(self):
+        """Return a list of member keys, in the order they were appended."""
+        return list(self._keys)
+
+    def size(self):
+        """Return the length of the string :py:meth:`build` would return."""
+        n = len(self._keys)
+        if n < 2:
+            return n and len(self._values[0])
+        return (2 * n) + 6 + n + self._data_len - (n * self._cp_len)
+
+    def build(self):
+        """Return the uncompressed batch value, or the value of the sole
+        member if only one exists."""
+        n = len(self._keys)
+        if n < 2:
+            return self._values[0] if n else ''
+
+        cp_len = self._cp_len
+        offsets = []
+        chunks = []
+        pos = (2 * n) + 6
+        for raw, value in zip(self._raws, self._values):
+            suffix = raw[cp_len:]
+            if len(suffix) > 255:
+                raise ValueError('batch key suffix too long.')
+            offsets.append(pos)
+            chunks.append(chr(len(suffix)))
+            chunks.append(suffix)
+            chunks.append(value)
+            pos += 1 + len(suffix) + len(value)
+        if pos > 0xffff:
+            raise ValueError('batch too large.')
+        offsets.append(pos)
+        header = struct.pack('>%dH' % (n + 2), n, *offsets) + '\0\0'
+        return header + ''.join(chunks)
+
+
+class BatchV3Iterator(BatchV2Iterator):
+    """Like :py:class:`BatchV2Iterator`, except for batches whose values are
+    split into independently compressed blocks, with an uncompressed index of
+    members. A member's block is only decompressed when its :py:attr:`data`
+    is accessed, and only the most recently used block is retained.
+
+        `engine`:
+            :py:class:`acid.engines.Engine` instance to iterate.
+
+        `prefix`:
+            Bytestring prefix for all keys.
+
+        `compressor`:
+            :py:class:`acid.encoders.Compressor` instance used to decompress
+            batch blocks.
+    """
+    #: Offset of the block table within the batch.
+    _block_table = None
+    #: Index of the cached decompressed block, or ``None``.
+    _block_index = None
+    #: Cached decompressed block.
+    _block_data = None
+    #: `(block, start, end)` for the current batch member, or ``None`` if
+    #: `_data` holds the current data.
+    _member = None
+    _data = None
+
+    def _get_data(self):
+        if self._member is not None:
+            block, start, end = self._member
+            self._data = self._load_block(block)[start:end]
+            self._member = None
+        return self._data
+
+    def _set_data(self, data):
+        self._data = data
+        self._member = None
+
+    data = property(_get_data, _set_data)
+
+    def _load_batch(self):
+        """Decode the batch header, leaving blocks compressed."""
+        self._key_count, nblocks = struct.unpack_from('>II', self.raw)
+        self._block_table = 8 + (12 * (1 + self._key_count))
+        self._block_index = None
+        self._block_data = None
+
+    def _load_block(self, block):
+        if block != self._block_index:
+            pos = self._block_table + (4 * block)
+            start, end = struct.unpack_from('>II', self.raw, pos)
+            raw = buffer(self.raw, start, end - start)
+            self._block_data = self._unpack(raw, block)
+            self._block_index = block
+        return self._block_data
+
+    def _load_item(self, index):
+        pos = 8 + (12 * index)
+        key_start, block, start, key_end, next_block, next_start = \
+            struct.unpack_from('>IIIIII', self.raw, pos)
+        suffix = self.raw[key_start:key_end]
+        self.key = keylib.Key.from_raw(self._cp + suffix)
+        self._member = (block, start,
+                        next_start if next_block == block else None)
+
+    def find(self, key):
+        """Return the data for `key` if it exists, otherwise ``None``. Only
+        the block containing `key` is decompressed."""
+        key = keylib.Key(key)
+        self.it = self.engine.iter(key.to_raw(self.prefix), False)
+        self._reverse = False
+        self._index = 0
+        self._max_phys = 1
+        if not self._step():
+            return None
+        if len(self.keys) == 1:
+            return bytes(self.data) if self.key == key else None
+
+        lo = 0
+        hi = self._key_count
+        while lo < hi:
+            mid = (lo + hi) // 2
+            self._load_item(mid)
+            if self.key < key:
+                lo = mid + 1
+            else:
+                hi = mid
+        if lo < self._key_count:
+            self._load_item(lo)
+            if self.key == key:
+                return bytes(self.data)
+
+
+class BatchV3Builder(object):
+    """Incrementally accumulates the members of a batch record in the format
+    read by :py:class:`BatchV3Iterator`. Members must be appended in key
+    order. Member values are grouped into blocks of roughly `block_size`
+    bytes, each compressed independently using `compressor`. Completed blocks
+    are compressed once, so maintaining the encoded size only requires
+    recompressing the final block.
+    """
+    def __init__(self, compressor, block_size=4096):
+        self.compressor = compressor
+        self.block_size = block_size
+        self.clear()
+
+    def __len__(self):
+        return len(self._keys)
+
+    def clear(self):
+        """Remove all members."""
+        self._keys = []
+        self._raws = []
+        #: `(block, offset)` for each member.
+        self._members = []
+        #: Compressed completed blocks.
+        self._blocks = []
+        #: Lists of member values for each completed block.
+        self._block_values = []
+        #: Total length of `_blocks`.
+        self._blocks_len = 0
+        #: Member values in the final, open block.
+        self._open = []
+        self._open_len = 0
+        #: Cached compressed open block, or ``None``.
+        self._open_packed = None
+        #: Total length of raw keys.
+        self._key_len = 0
+        #: Length of the prefix shared by the first and last key.
+        self._cp_len = 0
+
+    def append(self, key, value):
+        """Append a member with the :py:class:`acid.keylib.Key` `key` and
+        bytestring or buffer `value`."""
+        if self._open_len >= self.block_size:
+            packed = bytes(self.compressor.pack(''.join(self._open)))
+            self._blocks.append(packed)
+            self._block_values.append(self._open)
+            self._blocks_len += len(packed)
+            self._open = []
+            self._open_len = 0
+
+        key = keylib.Key(key)
+        raw = key.to_raw()
+        value = bytes(value)
+        self._keys.append(key)
+        self._raws.append(raw)
+        self._members.append((len(self._blocks), self._open_len))
+        self._open.append(value)
+        self._open_len += len(value)
+        self._open_packed = None
+        self._key_len += len(raw)
+        self._cp_len = common_prefix_len(self._raws[0], raw)
+
+    def pop(self):
+        """Remove the most recently appended member."""
+        self._keys.pop()
+        self._key_len -= len(self._raws.pop())
+        self._members.pop()
+        self._open_len -= len(self._open.pop())
+        self._open_packed = None
+        if self._blocks and not self._open:
+            # Reopen the previous block.
+            self._blocks_len -= len(self._blocks.pop())
+            self._open = self._block_values.pop()
+            self._open_len = sum(len(value) for value in self._open)
+        if self._raws:
+            self._cp_len = common_prefix_len(self._raws[0], self._raws[-1])
+
+    def keys(self):
+        """Return a list of member keys, in the order they were appended."""
+        return list(self._keys)
+
+    def _pack_open(self):
+        if self._open_packed is None:
+            self._open_packed = bytes(self.compressor.pack(''.join(self._open)))
+        return self._open_packed
+
+    def size(self):
+        """Return the length of the string :py:meth:`build` would return."""
+        n = len(self._keys)
+        if n < 2:
+            return n and self._open_len
+        nblocks = 1 + len(self._blocks)
+        return (8 + (12 * (n + 1)) + (4 * (nblocks + 1)) +
+                self._key_len - (n * self._cp_len) +
+                self._blocks_len + len(self._pack_open()))
+
+    def build(self):
+        """Return the batch value, or the value of the sole member if only one
+        exists."""
+        n = len(self._keys)
+        if n < 2:
+            return self._open[0] if n else ''
+
+        cp_len = self._cp_len
+        blocks = self._blocks + [self._pack_open()]
+        suffixes = [raw[cp_len:] for raw in self._raws]
+
+        pos = 8 + (12 * (n + 1)) + (4 * (len(blocks) + 1))
+        members = []
+        for suffix, (block, offset) in zip(suffixes, self._members):
+            members.extend((pos, block, offset))
+            pos += len(suffix)
+        members.extend((pos, len(blocks), 0))
+
+        block_offsets = []
+        for block in blocks:
+            block_offsets.append(pos)
+            pos += len(block)
+        block_offsets.append(pos)
+
+        header = struct.pack('>II%dI%dI' % (len(members), len(block_offsets)),
+                             n, len(blocks), *(members + block_offsets))
+        return header + ''.join(suffixes) + ''.join(blocks)
+
+
+class ColumnarBatchIterator(BatchV2Iterator):
+    """Like :py:class:`BatchV2Iterator`, except for batches whose members are
+    :py:class:`acid.structlib.Struct` values stored column-major by
+    :py:class:`ColumnarBatchBuilder`. Member values are reassembled from their
+    columns when a batch is first visited, unless :py:meth:`set_fields` was
+    called, in which case only the requested columns are decoded.
+
+        `engine`:
+            :py:class:`acid.engines.Engine` instance to iterate.
+
+        `prefix`:
+            Bytestring prefix for all keys.
+
+        `compressor`:
+            :py:class:`acid.encoders.Compressor` instance used to decompress
+            batch keys.
+
+        `struct_type`:
+            :py:class:`acid.structlib.StructType` of the members.
+    """
+    #: List of :py:class:`acid.structlib._Field` to project, or ``None``.
+    _fields = None
+    #: Tuple of the projected field values of the current record.
+    values = None
+
+    def __init__(self, engine, prefix, compressor, struct_type, cache=None):
+        super(ColumnarBatchIterator, self).__init__(engine, prefix,
+                                                    compressor, cache)
+        self.struct_type = struct_type
+
+    def set_fields(self, names):
+        """Decode only the fields named by the sequence `names`, exposing
+        their values as the tuple :py:attr:`values` of each result, rather
+        than reassembling :py:attr:`data`."""
+        by_name = dict((f.name, f) for f in self.struct_type.sorted_by_id)
+        for name in names:
+            if name not in by_name:
+                raise ValueError('unknown field: %r' % (name,))
+        self._fields = [by_name[name] for name in names]
+
+    def _load_batch(self):
+        data = self._unpack(self.raw)
+        pos, n = structlib.read_varint(data, 0)
+        suffixes = []
+        for _ in xrange(n):
+            pos, suffix_len = structlib.read_varint(data, pos)
+            suffixes.append(data[pos:pos+suffix_len])
+            pos += suffix_len
+        self._suffixes = suffixes
+        self._key_count = n
+
+        reader = structlib.ColumnReader(self.struct_type, data, pos, n)
+        if self._fields is None:
+            self._rows = reader.rows()
+        else:
+            self._columns = [reader.values(f) for f in self._fields]
+
+    def _load_item(self, index):
+        self.key = keylib.Key.from_raw(self._cp + self._suffixes[index])
+        if self._fields is None:
+            self.data = self._rows[index]
+        else:
+            self.values = tuple(column[index] for column in self._columns)
+
+    def _step(self):
+        go = super(ColumnarBatchIterator, self)._step()
+        if go and self._fields is not None and len(self.keys) == 1:
+            raw = bytes(self.data)
+            read = self.struct_type.read_value
+            self.values = tuple(read(raw, f) for f in self._fields)
+        return go
+
+
+class ColumnarBatchBuilder(BatchV2Builder):
+    """Incrementally accumulates the members of a batch record in the format
+    read by :py:class:`ColumnarBatchIterator`. Members must be appended in key
+    order, and their values must be encoded `struct_type` instances. Since
+    the encoding depends on every member, :py:meth:`size` encodes the batch.
+    """
+    def __init__(self, struct_type):
+        super(ColumnarBatchBuilder, self).__init__()
+        self.struct_type = struct_type
+
+    def clear(self):
+        """Remove all members."""
+        self.__init__(self.struct_type)
+
+    def size(self):
+        """Return the length of the string :py:meth:`build` would return."""
+        return len(self.build())
+
+    def build(self):
+        """Return the uncompressed batch value, or the value of the sole
+        member if only one exists."""
+        n = len(self._keys)
+        if n < 2:
+            return self._values[0] if n else ''
+
+        out = bytearray()
+        w = out.extend
+        structlib.write_varint(w, n)
+        for raw in self._raws:
+            suffix = raw[self._cp_len:]
+            structlib.write_varint(w, len(suffix))
+            w(suffix)
+        w(structlib.pack_columns(self.struct_type, self._values))
+        return str(out)
+
+
 def from_args(it, key, lo, hi, prefix, reverse, max_, include, max_phys):
     """This function is a stand-in until the core.py API is refurbished."""
     if key:
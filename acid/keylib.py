@@ -33,7 +33,7 @@ import acid
 
 
 __all__ = ['Key', 'KeyList', 'invert', 'unpacks', 'packs', 'unpack_int',
-           'pack_int']
+           'pack_int', 'sorted_diff']
 
 KIND_NULL = 0x0f
 KIND_NEG_INTEGER = 0x14
@@ -720,6 +720,42 @@ def unpack(s, prefix=None):
     return unpacks(s, prefix, True)
 
 
+def _skip_equal(lst, i):
+    """Return the index of the first element following `lst[i]` that differs
+    from it."""
+    x = lst[i]
+    i += 1
+    while i < len(lst) and lst[i] == x:
+        i += 1
+    return i
+
+
+def sorted_diff(old, new):
+    """Given two sorted lists of bytestrings, return `(removed, added)`, where
+    `removed` lists the distinct elements only in `old`, and `added` lists the
+    distinct elements only in `new`, both in sorted order."""
+    removed = []
+    added = []
+    i = j = 0
+    while i < len(old) and j < len(new):
+        if old[i] < new[j]:
+            removed.append(old[i])
+            i = _skip_equal(old, i)
+        elif old[i] > new[j]:
+            added.append(new[j])
+            j = _skip_equal(new, j)
+        else:
+            i = _skip_equal(old, i)
+            j = _skip_equal(new, j)
+    while i < len(old):
+        removed.append(old[i])
+        i = _skip_equal(old, i)
+    while j < len(new):
+        added.append(new[j])
+        j = _skip_equal(new, j)
+    return removed, added
+
+
 if acid._use_speedups:
     try:
         from acid._keylib import *
@@ -22,6 +22,8 @@ import sys
 import types
 import uuid
 
+import acid
+
 try:
     import __pypy__.builders
 except ImportError:
@@ -38,6 +40,23 @@ WIRE_TYPE_64           = 1
 WIRE_TYPE_DELIMITED    = 2
 WIRE_TYPE_32           = 5
 
+#: Codes for scalar field kinds the C extension reads and writes without
+#: calling the field's coder. Must match enum NativeKind in ext/structlib.c.
+NATIVE_KINDS = {
+    'varint': 1,
+    'uvarint': 2,
+    'svarint': 3,
+    'bool': 4,
+    'double': 5,
+    'float': 6,
+    'i32': 7,
+    'i64': 8,
+    'u32': 9,
+    'u64': 10,
+    'blob': 11,
+    'text': 12,
+}
+
 
 #
 # Encoding functions.
@@ -127,7 +146,7 @@ def read_varint(buf, pos):
                      | ((b3 & 0x7f) << 21) \
                      | ((b2 & 0x7f) << 14) \
                      | ((b1 & 0x7f) << 7)  \
-                     | ((b0 & 0xff))
+                     | ((b0 & 0x7f))
         if n > (2**63-1):  # exceeds int64_t, must be signed, so cast it
             n -= (1 << 64)
         return pos+10, n
@@ -386,14 +405,17 @@ class _DelimitedCoder(_Coder):
     def _get_offsets(self, field, buf, pos):
         offsets = []
         blen = len(buf)
-        wire_key = field.wire_key
-        while wire_key == field.wire_key:
+        while True:
             offsets.append(pos)
             pos, n = read_varint(buf, pos)
             pos += n
             if pos >= blen:
                 break
-            pos, wire_key = read_varint(buf, pos)
+            # Leave the following field's key unread.
+            next_pos, wire_key = read_varint(buf, pos)
+            if wire_key != field.wire_key:
+                break
+            pos = next_pos
         return pos, offsets
 
     def read_value(self, field, buf, pos):
@@ -419,6 +441,8 @@ class _Field(object):
         else:
             self.coder = _ScalarCoder()
         self.wire_key = self.coder.make_key(self)
+        #: NATIVE_KINDS code, or 0 if values must be passed to `coder`.
+        self.native = 0 if sequence else NATIVE_KINDS.get(self.KIND, 0)
 
         ba = bytearray()
         write_varint(ba.extend, self.wire_key)
@@ -517,10 +541,11 @@ class _FloatField(_Field):
 
     def read(self, buf, pos):
         epos = pos + 4
-        return epos, struct.unpack('f', buf[pos:epos])[0]
+        return epos, struct.unpack('<f', buf[pos:epos])[0]
 
     def write(self, o, w):
-        w(struct.pack('f', o))
+        # Unlike 'f', '<f' raises OverflowError for values out of range.
+        w(struct.pack('<f', o))
 
 
 class _VarIntField(_Field):
@@ -555,15 +580,16 @@ class _SVarIntField(_VarIntField):
 
     def read(self, buf, pos):
         pos, value = read_varint(buf, pos)
+        value &= (2**64)-1
         if value & 1:
             return pos, ((value >> 1) ^ ~0)
         return pos, value >> 1
 
     def write(self, o, w):
-        if i < 0:
-            write_varint(w, (i << 1) ^ ~0)
+        if o < 0:
+            write_varint(w, (o << 1) ^ ~0)
         else:
-            write_varint(w, i << 1)
+            write_varint(w, o << 1)
 
 
 class _Inet4Field(_Field):
@@ -710,6 +736,8 @@ class _Property(object):
         self.struct_type = struct_type
         self.field = field
         self.name = field.name
+        self.wire_key = field.wire_key
+        self.native = field.native
 
     def __delete__(self, instance):
         instance.__dict__[self.name] = None
@@ -718,7 +746,8 @@ class _Property(object):
 class _ScalarProperty(_Property):
     def __get__(self, instance, owner):
         if self.name not in instance.__dict__:
-            return self.struct_type.read_value(instance._buf, self.field)
+            return read_cached(instance, self.wire_key, self.native,
+                               self.field)
         return instance.__dict__[self.name]
 
     def __set__(self, instance, value):
@@ -729,7 +758,8 @@ class _ScalarProperty(_Property):
 class _SequenceProperty(_Property):
     def __get__(self, instance, owner):
         if self.name not in instance.__dict__:
-            value = self.struct_type.read_value(instance._buf, self.field)
+            value = read_cached(instance, self.wire_key, self.native,
+                                self.field)
             instance.__dict__[self.name] = value
             return value
         return instance.__dict__[self.name]
@@ -739,10 +769,121 @@ class _SequenceProperty(_Property):
         instance.__dict__[self.name] = value
 
 
+def decode_fields(buf, fields):
+    """Return a list of `(name, value)` for each field encoded in `buf`, in the
+    order they appear, where `fields` maps the wire key of each known field to
+    `(name, native, field)`. Unknown fields are skipped."""
+    out = []
+    blen = len(buf)
+    pos = 0
+    while pos < blen:
+        pos, wire_key = read_varint(buf, pos)
+        entry = fields.get(wire_key)
+        if entry:
+            field = entry[2]
+            pos, value = field.coder.read_value(field, buf, pos)
+            out.append((entry[0], value))
+        else:
+            pos = SKIP_MAP[wire_key & 0x7](buf, pos)
+    return out
+
+
+def read_cached(struct, wire_key, native, field):
+    """Like :py:func:`read_field`, but using the field offset table of the
+    :py:class:`Struct` `struct`. The table maps wire keys to the offset of
+    their first value, and is filled as the buffer is scanned, so no part of
+    the buffer is scanned twice. The offset scanning resumes at is stored
+    under -1."""
+    offsets = struct._offsets
+    if offsets is None:
+        offsets = {}
+        struct._offsets = offsets
+    pos = offsets.get(wire_key)
+    if pos is None:
+        buf = struct._buf
+        blen = len(buf)
+        i = offsets.get(-1, 0)
+        while pos is None and i < blen:
+            i, key = read_varint(buf, i)
+            offsets.setdefault(key, i)
+            if key == wire_key:
+                pos = i
+            i = SKIP_MAP[key & 0x7](buf, i)
+        offsets[-1] = i
+        if pos is None:
+            return
+    return field.coder.read_value(field, struct._buf, pos)[1]
+
+
+def project_fields(buf, fields, n):
+    """Return an `n`-tuple of values decoded from `buf`, where `fields` maps
+    the wire key of each wanted field to `(index, native, field)`. Only the
+    first occurrence of each field is decoded, and decoding stops once every
+    field was found. Missing fields are ``None``."""
+    out = [None] * n
+    remain = len(fields)
+    blen = len(buf)
+    pos = 0
+    while remain and pos < blen:
+        pos, wire_key = read_varint(buf, pos)
+        entry = fields.get(wire_key)
+        if entry and out[entry[0]] is None:
+            field = entry[2]
+            pos, out[entry[0]] = field.coder.read_value(field, buf, pos)
+            remain -= 1
+        else:
+            pos = SKIP_MAP[wire_key & 0x7](buf, pos)
+    return tuple(out)
+
+
+def read_field(buf, wire_key, native, field):
+    """Return the value of the first occurrence of `field` in `buf`, whose
+    wire key and :py:attr:`native` code are given, or ``None``."""
+    blen = len(buf)
+    pos = 0
+    while pos < blen:
+        pos, key = read_varint(buf, pos)
+        if key == wire_key:
+            _, value = field.coder.read_value(field, buf, pos)
+            return value
+        pos = SKIP_MAP[key & 0x7](buf, pos)
+
+
+if __pypy__:
+    def encode_fields(dct, fields):
+        """Return the encoding of values in the dict `dct`, where `fields` is
+        a list of `(name, wire key string, native, field)` in field ID
+        order. Fields missing from `dct` or ``None`` are omitted."""
+        bio = __pypy__.builders.StringBuilder()
+        w = bio.append
+        for name, _, _, field in fields:
+            value = dct.get(name)
+            if value is not None:
+                field.coder.write_value(field, value, w)
+        return bio.build()
+else:
+    def encode_fields(dct, fields):
+        """Return the encoding of values in the dict `dct`, where `fields` is
+        a list of `(name, wire key string, native, field)` in field ID
+        order. Fields missing from `dct` or ``None`` are omitted."""
+        ba = bytearray()
+        w = ba.extend
+        for name, _, _, field in fields:
+            value = dct.get(name)
+            if value is not None:
+                field.coder.write_value(field, value, w)
+        return str(ba)
+
+
 class StructType(object):
     def __init__(self):
         self.field_id_map = {}
         self.sorted_by_id = []
+        # Arguments to decode_fields() and encode_fields().
+        self._wire_fields = {}
+        self._encode_fields = []
+        # Map of field name tuple to project_fields() argument.
+        self._projections = {}
         self.klass = type('stct', (Struct,), {})
         self.new = self.klass
         self.klass._struct_type = self
@@ -766,48 +907,41 @@ class StructType(object):
         self.field_id_map[field_id] = field
         self.sorted_by_id.append(field)
         self.sorted_by_id.sort(key=lambda f: f.field_id)
+        self._wire_fields[field.wire_key] = (field.name, field.native, field)
+        self._encode_fields = [(f.name, f.wire_key_s, f.native, f)
+                               for f in self.sorted_by_id]
 
     def iter_raw(self, buf):
-        blen = len(buf)
-        pos = 0
-        while pos < blen:
-            pos, wire_key = read_varint(buf, pos)
-            field = self.field_id_map.get(wire_key >> 3)
-            if field:
-                pos, value = field.coder.read_value(field, buf, pos)
-                yield field.name, value
-            else:
-                pos = SKIP_MAP[wire_key & 0x7](buf, pos)
+        return iter(decode_fields(buf, self._wire_fields))
 
     def read_value(self, buf, field):
-        target_wire_key = field.wire_key
-        blen = len(buf)
-        pos = 0
-        while pos < blen:
-            pos, wire_key = read_varint(buf, pos)
-            if wire_key == target_wire_key:
-                _, value = field.coder.read_value(field, buf, pos)
-                return value
-            pos = SKIP_MAP[wire_key & 0x7](buf, pos)
-
-    if __pypy__:
-        def _to_raw(self, dct):
-            bio = __pypy__.builders.StringBuilder()
-            w = bio.append
-            for field in self.sorted_by_id:
-                value = dct.get(field.name)
-                if value is not None:
-                    field.coder.write_value(field, value, w)
-            return bio.build()
-    else:
-        def _to_raw(self, dct):
-            ba = bytearray()
-            w = ba.extend
-            for field in self.sorted_by_id:
-                value = dct.get(field.name)
-                if value is not None:
-                    field.coder.write_value(field, value, w)
-            return str(ba)
+        return read_field(buf, field.wire_key, field.native, field)
+
+    def projection(self, names):
+        """Return the argument to :py:func:`project_fields` for the tuple of
+        field names `names`, raising :py:class:`ValueError` if any field is
+        unknown or repeated."""
+        fields = self._projections.get(names)
+        if fields is None:
+            by_name = dict((f.name, f) for f in self.sorted_by_id)
+            fields = {}
+            for i, name in enumerate(names):
+                field = by_name.get(name)
+                if field is None:
+                    raise ValueError('unknown field: %r' % (name,))
+                if field.wire_key in fields:
+                    raise ValueError('duplicate field: %r' % (name,))
+                fields[field.wire_key] = (i, field.native, field)
+            self._projections[names] = fields
+        return fields
+
+    def project(self, buf, names):
+        """Return a tuple of the values of fields named by the tuple `names`
+        from the encoded struct `buf`, decoding no other fields."""
+        return project_fields(buf, self.projection(names), len(names))
+
+    def _to_raw(self, dct):
+        return encode_fields(dct, self._encode_fields)
 
     def _explode(self, struct):
         dct = struct.__dict__
@@ -823,7 +957,7 @@ class StructType(object):
         struct._buf = buf
         return struct
 
-    HIDE_FIELDS = set(['_buf', '_struct_type'])
+    HIDE_FIELDS = set(['_buf', '_offsets', '_struct_type'])
     def iter_struct(self, struct):
         self._explode(struct)
         dct = struct.__dict__
@@ -833,12 +967,301 @@ class StructType(object):
 
 class Struct(object):
     _buf = ''
+    #: Field offset table; see read_cached().
+    _offsets = None
     def __repr__(self):
         typ = type(self)
         d = dict(self._struct_type.iter_struct(self))
         return '<%s.%s(%s)>' % (typ.__module__, typ.__name__, d)
 
 
+#
+# Columnar batch encoding.
+#
+
+#: Column values stored as their wire encoding.
+COLUMN_RAW = 0
+#: Column values stored as zigzag varint deltas from the previous value.
+COLUMN_DELTA = 1
+#: Column values stored as varint indices into a table of distinct values.
+COLUMN_DICT = 2
+#: Column values stored as length-prefixed runs of a sequence field's wire
+#: values, with the wire key of all but the first value.
+COLUMN_RUN = 3
+
+#: Field kinds whose columns are delta encoded.
+_DELTA_KINDS = frozenset(['varint', 'uvarint', 'svarint',
+                          'i32', 'i64', 'u32', 'u64'])
+#: Field kinds whose columns are dictionary coded when values repeat.
+_DICT_KINDS = frozenset(['text', 'blob'])
+#: Format of fixed-width wire values, indexed by wire type.
+_FIXED_FORMATS = {WIRE_TYPE_64: '<q', WIRE_TYPE_32: '<i'}
+
+
+def _write_delta(w, i):
+    """Write the unbounded integer `i` as a zigzag varint."""
+    i = (i << 1) if i >= 0 else (((-i) << 1) - 1)
+    while i >= 0x80:
+        w(chr(0x80 | (i & 0x7f)))
+        i >>= 7
+    w(chr(i))
+
+
+def _read_delta(buf, pos):
+    """Read an integer written by :py:func:`_write_delta`."""
+    i = 0
+    shift = 0
+    while True:
+        b = ord(buf[pos])
+        pos += 1
+        i |= (b & 0x7f) << shift
+        if b < 0x80:
+            break
+        shift += 7
+    if i & 1:
+        return pos, -((i + 1) >> 1)
+    return pos, i >> 1
+
+
+def _wire_int(wire_type, value):
+    """Return the wire encoding `value` as a signed integer."""
+    if wire_type == WIRE_TYPE_VARIABLE:
+        return read_varint(value, 0)[1]
+    return struct.unpack(_FIXED_FORMATS[wire_type], value)[0]
+
+
+def _int_wire(wire_type, i):
+    """Return the wire encoding of integer `i`."""
+    if wire_type == WIRE_TYPE_VARIABLE:
+        ba = bytearray()
+        write_varint(ba.extend, i)
+        return str(ba)
+    return struct.pack(_FIXED_FORMATS[wire_type], i)
+
+
+def _write_bitmap(w, values):
+    """Write a bitmap with a set bit for each value that is not ``None``."""
+    ba = bytearray((len(values) + 7) // 8)
+    for i, value in enumerate(values):
+        if value is not None:
+            ba[i >> 3] |= 1 << (i & 7)
+    w(ba)
+
+
+def pack_columns(struct_type, rows):
+    """Return the column-major encoding of `rows`, a list of encoded
+    `struct_type` values. The first occurrence of each field is stored in a
+    column holding that field for every row, while unknown and repeated
+    fields are kept per row in their original order. Columns are ordered by
+    field ID, matching the order :py:meth:`StructType.to_raw` writes fields,
+    so such values are reassembled byte for byte.
+    """
+    n = len(rows)
+    fields = struct_type.sorted_by_id
+    columns = dict((f.wire_key, [None] * n) for f in fields)
+    sequences = set(f.wire_key for f in fields if f.sequence)
+    rest = [None] * n
+    for i, buf in enumerate(rows):
+        other = []
+        last = None
+        blen = len(buf)
+        pos = 0
+        while pos < blen:
+            start = pos
+            pos, wire_key = read_varint(buf, pos)
+            vpos = pos
+            pos = SKIP_MAP[wire_key & 0x7](buf, pos)
+            column = columns.get(wire_key)
+            if column is not None and column[i] is None:
+                column[i] = [buf[vpos:pos]]
+            elif column is not None and column is last \
+                    and wire_key in sequences:
+                # Continue the run of a delimited sequence.
+                column[i].append(buf[start:pos])
+            else:
+                other.append(buf[start:pos])
+                column = None
+            last = column
+        if other:
+            rest[i] = ''.join(other)
+
+    out = bytearray()
+    w = out.extend
+    packed = []
+    for field in fields:
+        values = columns[field.wire_key]
+        present = [''.join(v) for v in values if v is not None]
+        if not present:
+            continue
+
+        body = bytearray()
+        bw = body.extend
+        _write_bitmap(bw, values)
+        if field.sequence:
+            encoding = COLUMN_RUN
+            for value in present:
+                write_varint(bw, len(value))
+                bw(value)
+        elif field.KIND in _DELTA_KINDS:
+            encoding = COLUMN_DELTA
+            wire_type = field.wire_key & 0x7
+            prev = 0
+            for value in present:
+                i = _wire_int(wire_type, value)
+                _write_delta(bw, i - prev)
+                prev = i
+        elif (field.KIND in _DICT_KINDS and
+              len(set(present)) <= (len(present) // 2)):
+            encoding = COLUMN_DICT
+            index = {}
+            for value in present:
+                index.setdefault(value, len(index))
+            write_varint(bw, len(index))
+            for value in sorted(index, key=index.get):
+                bw(value)
+            for value in present:
+                write_varint(bw, index[value])
+        else:
+            # Wire values are self-delimiting given the wire type.
+            encoding = COLUMN_RAW
+            for value in present:
+                bw(value)
+        packed.append((field.wire_key, encoding, body))
+
+    write_varint(w, len(packed))
+    for wire_key, encoding, body in packed:
+        write_varint(w, wire_key)
+        w(chr(encoding))
+        write_varint(w, len(body))
+        w(body)
+
+    _write_bitmap(w, rest)
+    for value in rest:
+        if value is not None:
+            write_varint(w, len(value))
+            w(value)
+    return str(out)
+
+
+class ColumnReader(object):
+    """Decodes the output of :py:func:`pack_columns` for `n` rows of
+    `struct_type`, starting at `pos` in `buf`. Only the column directory is
+    parsed during construction; columns are decoded on demand.
+    """
+    def __init__(self, struct_type, buf, pos, n):
+        self.struct_type = struct_type
+        self.buf = buf
+        self.n = n
+        #: List of `(wire_key, encoding, start, end)` in field ID order.
+        self._columns = []
+        pos, ncols = read_varint(buf, pos)
+        for _ in xrange(ncols):
+            pos, wire_key = read_varint(buf, pos)
+            encoding = ord(buf[pos])
+            pos, size = read_varint(buf, pos + 1)
+            self._columns.append((wire_key, encoding, pos, pos + size))
+            pos += size
+        self._rest_pos = pos
+        self._rest = None
+
+    def _present(self, pos):
+        """Return a list of row indices whose bits are set in the bitmap at
+        `pos`, and the position following it."""
+        epos = pos + ((self.n + 7) // 8)
+        bits = bytearray(self.buf[pos:epos])
+        return [i for i in xrange(self.n) if bits[i >> 3] & (1 << (i & 7))], epos
+
+    def _wire_values(self, wire_key, encoding, pos):
+        """Return a list of each row's wire value for the column at `pos`, or
+        ``None`` for rows lacking the field."""
+        buf = self.buf
+        present, pos = self._present(pos)
+        values = [None] * self.n
+        wire_type = wire_key & 0x7
+        if encoding == COLUMN_DELTA:
+            i = 0
+            for row in present:
+                pos, delta = _read_delta(buf, pos)
+                i += delta
+                values[row] = _int_wire(wire_type, i)
+        elif encoding == COLUMN_RUN:
+            for row in present:
+                pos, size = read_varint(buf, pos)
+                values[row] = buf[pos:pos+size]
+                pos += size
+        elif encoding == COLUMN_DICT:
+            skip = SKIP_MAP[wire_type]
+            pos, count = read_varint(buf, pos)
+            table = []
+            for _ in xrange(count):
+                epos = skip(buf, pos)
+                table.append(buf[pos:epos])
+                pos = epos
+            for row in present:
+                pos, idx = read_varint(buf, pos)
+                values[row] = table[idx]
+        else:
+            skip = SKIP_MAP[wire_type]
+            for row in present:
+                epos = skip(buf, pos)
+                values[row] = buf[pos:epos]
+                pos = epos
+        return values
+
+    def rest(self):
+        """Return a list of each row's unknown and repeated fields, or
+        ``None`` for rows having none."""
+        if self._rest is None:
+            buf = self.buf
+            present, pos = self._present(self._rest_pos)
+            self._rest = [None] * self.n
+            for row in present:
+                pos, size = read_varint(buf, pos)
+                self._rest[row] = buf[pos:pos+size]
+                pos += size
+        return self._rest
+
+    def rows(self):
+        """Return a list of the encoded value of each row."""
+        chunks = [[] for _ in xrange(self.n)]
+        for wire_key, encoding, start, _ in self._columns:
+            ba = bytearray()
+            write_varint(ba.extend, wire_key)
+            key_s = str(ba)
+            values = self._wire_values(wire_key, encoding, start)
+            for row, value in enumerate(values):
+                if value is not None:
+                    chunks[row].append(key_s)
+                    chunks[row].append(value)
+        for row, value in enumerate(self.rest()):
+            if value is not None:
+                chunks[row].append(value)
+        return [''.join(chunk) for chunk in chunks]
+
+    def values(self, field):
+        """Return a list of each row's decoded value for `field`, or ``None``
+        for rows lacking it. Only the field's column is decoded; a field
+        without a column, such as one added to `struct_type` after the batch
+        was written, is read from each row's remaining fields."""
+        for wire_key, encoding, start, _ in self._columns:
+            if wire_key == field.wire_key:
+                break
+        else:
+            read = self.struct_type.read_value
+            return [None if rest is None else read(rest, field)
+                    for rest in self.rest()]
+
+        values = self._wire_values(wire_key, encoding, start)
+        if encoding == COLUMN_DICT:
+            # Decode each distinct value once.
+            decoded = dict((value, field.read(value, 0)[1])
+                           for value in set(values) if value is not None)
+            return [decoded.get(value) for value in values]
+        read = field.coder.read_value
+        return [None if value is None else read(field, value, 0)[1]
+                for value in values]
+
+
 #: Mapping of _Field subclass to field kind.
 FIELD_KINDS = {}
 _stack = [_Field]
@@ -848,3 +1271,10 @@ while _stack:
     if _k.KIND:
         FIELD_KINDS[_k.KIND] = _k
 del _k, _stack
+
+
+if acid._use_speedups:
+    try:
+        from acid._structlib import *
+    except ImportError:
+        pass
@@ -20,6 +20,10 @@ Basic tools for working with Acid stores.
     info: Dump all database information.
 
     shell: Open interactive console with ENV set to the open environment.
+
+    train [name]: Train a new dictionary for the DictCompressor named `name`
+        (default "<coll>_dict") from the collection given by -c, whose
+        batches are read using the compressor given by -z.
 """
 
 from __future__ import absolute_import
@@ -46,6 +50,8 @@ def make_parser():
     parser.usage = '%prog [options] <command>\n' + __doc__.rstrip()
     parser.add_option('-d', '--db', help='Database URL to open')
     parser.add_option('-c', '--coll', help='Collection to change')
+    parser.add_option('-z', '--compressor', default='plain',
+                      help='Compressor the collection was written with')
     return parser
 
 
@@ -67,6 +73,37 @@ def cmd_info(opts, args):
         pprint.pprint(list(STORE._meta.items()))
 
 
+def _get_compressor(name):
+    for encoder in acid.encoders._ENCODERS:
+        if encoder.name == name and \
+                isinstance(encoder, acid.encoders.Compressor):
+            return encoder
+    compressor = acid.encoders.DictCompressor(name)
+    with STORE.begin(write=True):
+        STORE.add_encoder(compressor)
+    return compressor
+
+
+def cmd_train(opts, args):
+    if not opts.coll:
+        die('Please specify collection (-c, --coll)')
+    name = args[0] if args else ('%s_dict' % opts.coll)
+    info = STORE.get_meta(acid.core.KIND_TABLE, opts.coll)
+    if not info:
+        die('No such collection: %r', opts.coll)
+
+    compressor = acid.encoders.DictCompressor(name)
+    current = compressor
+    if opts.compressor != name:
+        current = _get_compressor(opts.compressor)
+    with STORE.begin(write=True):
+        STORE.add_encoder(compressor)
+    coll = acid.Collection(STORE, info, compressor=current)
+    version = STORE.train_compressor(compressor, coll)
+    print 'Trained %r version %d (%d bytes)' %\
+        (name, version, len(compressor.get_dict(version)))
+
+
 def _get_term_width(default=80):
     try:
         s = fcntl.ioctl(sys.stdout.fileno(), termios.TIOCGWINSZ, '1234')
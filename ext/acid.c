@@ -221,4 +221,10 @@ init_acid(void)
     if(acid_init_iterators_module()) {
         return;
     }
+    if(acid_init_encoders_module()) {
+        return;
+    }
+    if(acid_init_structlib_module()) {
+        return;
+    }
 }
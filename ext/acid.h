@@ -286,6 +286,9 @@ int acid_memcmp(Slice *s1, Slice *s2);
 
 int acid_init_keylib_module(void);
 int acid_init_iterators_module(void);
+int acid_init_encoders_module(void);
+int acid_init_structlib_module(void);
+PyTypeObject *acid_init_batch_builder_type(void);
 
 PyObject *
 acid_import_object(const char *module, ...);
@@ -0,0 +1,372 @@
+/*
+ * Copyright 2013, David Wilson.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy
+ * of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ */
+
+#include "acid.h"
+
+#include <assert.h>
+#include <string.h>
+
+
+/** Initial member array and data buffer capacity. */
+#define BUILDER_START_MEMBERS 16
+#define BUILDER_START_BYTES 512
+
+
+struct member {
+    /** Offset of the member's raw key in `buf`; its value follows. */
+    Py_ssize_t offset;
+    /** Length of the raw key. */
+    Py_ssize_t key_len;
+    /** Length of the value. */
+    Py_ssize_t value_len;
+};
+
+typedef struct {
+    PyObject_HEAD
+    /** List of member Keys, in append order. */
+    PyObject *keys;
+    /** Array of member extents, `count` in use. */
+    struct member *members;
+    Py_ssize_t count;
+    Py_ssize_t members_size;
+    /** Concatenation of each member's raw key and value, `buf_len` in use. */
+    uint8_t *buf;
+    Py_ssize_t buf_len;
+    Py_ssize_t buf_size;
+    /** Length of the prefix shared by the first and last key. */
+    Py_ssize_t cp_len;
+} BatchV2Builder;
+
+
+static PyTypeObject BatchV2BuilderType;
+
+
+/**
+ * Return the length of the common prefix of members `m1` and `m2`.
+ */
+static Py_ssize_t
+common_prefix_len(BatchV2Builder *self, struct member *m1, struct member *m2)
+{
+    Py_ssize_t len = (m1->key_len < m2->key_len) ? m1->key_len : m2->key_len;
+    uint8_t *p1 = self->buf + m1->offset;
+    uint8_t *p2 = self->buf + m2->offset;
+    Py_ssize_t i;
+    for(i = 0; i < len && p1[i] == p2[i]; i++);
+    return i;
+}
+
+/**
+ * Recompute `cp_len` following a change to the last member.
+ */
+static void
+update_cp_len(BatchV2Builder *self)
+{
+    if(self->count) {
+        self->cp_len = common_prefix_len(self, &self->members[0],
+                                         &self->members[self->count - 1]);
+    } else {
+        self->cp_len = 0;
+    }
+}
+
+/**
+ * Write `v` to `p` as a big endian 16 bit integer.
+ */
+static void
+write_u16(uint8_t *p, Py_ssize_t v)
+{
+    p[0] = (uint8_t) (v >> 8);
+    p[1] = (uint8_t) v;
+}
+
+
+/**
+ * BatchV2Builder.__new__().
+ */
+static PyObject *
+builder_new(PyTypeObject *cls, PyObject *args, PyObject *kwds)
+{
+    BatchV2Builder *self = (BatchV2Builder *) cls->tp_alloc(cls, 0);
+    if(! self) {
+        return NULL;
+    }
+
+    self->keys = PyList_New(0);
+    self->members = PyMem_Malloc(sizeof(struct member) *
+                                 BUILDER_START_MEMBERS);
+    self->buf = PyMem_Malloc(BUILDER_START_BYTES);
+    if(! (self->keys && self->members && self->buf)) {
+        Py_DECREF(self);
+        return PyErr_NoMemory();
+    }
+    self->members_size = BUILDER_START_MEMBERS;
+    self->buf_size = BUILDER_START_BYTES;
+    return (PyObject *) self;
+}
+
+/**
+ * BatchV2Builder.__del__().
+ */
+static void
+builder_dealloc(BatchV2Builder *self)
+{
+    Py_CLEAR(self->keys);
+    if(self->members) {
+        PyMem_Free(self->members);
+    }
+    if(self->buf) {
+        PyMem_Free(self->buf);
+    }
+    PyObject_Del(self);
+}
+
+/**
+ * BatchV2Builder.__len__().
+ */
+static Py_ssize_t
+builder_len(BatchV2Builder *self)
+{
+    return self->count;
+}
+
+/**
+ * BatchV2Builder.append(key, value).
+ */
+static PyObject *
+builder_append(BatchV2Builder *self, PyObject *args)
+{
+    PyObject *key_obj;
+    PyObject *value_obj;
+    if(! PyArg_ParseTuple(args, "OO", &key_obj, &value_obj)) {
+        return NULL;
+    }
+
+    Slice value;
+    if(acid_make_reader(&value, value_obj)) {
+        return NULL;
+    }
+
+    Key *key = acid_make_key(key_obj);
+    if(! key) {
+        return NULL;
+    }
+
+    Py_ssize_t key_len = Key_SIZE(key);
+    Py_ssize_t value_len = value.e - value.p;
+    Py_ssize_t need = self->buf_len + key_len + value_len;
+    if(need > self->buf_size) {
+        Py_ssize_t new_size = self->buf_size * 2;
+        while(new_size < need) {
+            new_size *= 2;
+        }
+        uint8_t *new_buf = PyMem_Realloc(self->buf, new_size);
+        if(! new_buf) {
+            Py_DECREF(key);
+            return PyErr_NoMemory();
+        }
+        self->buf = new_buf;
+        self->buf_size = new_size;
+    }
+
+    if(self->count == self->members_size) {
+        Py_ssize_t new_size = self->members_size * 2;
+        struct member *new_members = PyMem_Realloc(self->members,
+            sizeof(struct member) * new_size);
+        if(! new_members) {
+            Py_DECREF(key);
+            return PyErr_NoMemory();
+        }
+        self->members = new_members;
+        self->members_size = new_size;
+    }
+
+    if(PyList_Append(self->keys, (PyObject *) key)) {
+        Py_DECREF(key);
+        return NULL;
+    }
+
+    struct member *m = &self->members[self->count++];
+    m->offset = self->buf_len;
+    m->key_len = key_len;
+    m->value_len = value_len;
+    memcpy(self->buf + self->buf_len, Key_DATA(key), key_len);
+    memcpy(self->buf + self->buf_len + key_len, value.p, value_len);
+    self->buf_len = need;
+    Py_DECREF(key);
+
+    update_cp_len(self);
+    Py_RETURN_NONE;
+}
+
+/**
+ * BatchV2Builder.pop().
+ */
+static PyObject *
+builder_pop(BatchV2Builder *self)
+{
+    if(! self->count) {
+        PyErr_SetString(PyExc_IndexError, "pop from empty BatchV2Builder");
+        return NULL;
+    }
+
+    Py_ssize_t n = PyList_GET_SIZE(self->keys);
+    if(PyList_SetSlice(self->keys, n - 1, n, NULL)) {
+        return NULL;
+    }
+    self->buf_len = self->members[--self->count].offset;
+    update_cp_len(self);
+    Py_RETURN_NONE;
+}
+
+/**
+ * BatchV2Builder.clear().
+ */
+static PyObject *
+builder_clear(BatchV2Builder *self)
+{
+    if(PyList_SetSlice(self->keys, 0, PyList_GET_SIZE(self->keys), NULL)) {
+        return NULL;
+    }
+    self->count = 0;
+    self->buf_len = 0;
+    self->cp_len = 0;
+    Py_RETURN_NONE;
+}
+
+/**
+ * BatchV2Builder.keys().
+ */
+static PyObject *
+builder_keys(BatchV2Builder *self)
+{
+    return PyList_GetSlice(self->keys, 0, PyList_GET_SIZE(self->keys));
+}
+
+/**
+ * Return the length of the encoded batch.
+ */
+static Py_ssize_t
+builder_encoded_size(BatchV2Builder *self)
+{
+    Py_ssize_t n = self->count;
+    if(n < 2) {
+        return n ? self->members[0].value_len : 0;
+    }
+    return (2 * n) + 6 + n + self->buf_len - (n * self->cp_len);
+}
+
+/**
+ * BatchV2Builder.size().
+ */
+static PyObject *
+builder_size(BatchV2Builder *self)
+{
+    return PyInt_FromSsize_t(builder_encoded_size(self));
+}
+
+/**
+ * BatchV2Builder.build().
+ */
+static PyObject *
+builder_build(BatchV2Builder *self)
+{
+    Py_ssize_t n = self->count;
+    if(n < 2) {
+        if(! n) {
+            return PyString_FromStringAndSize("", 0);
+        }
+        struct member *m = &self->members[0];
+        return PyString_FromStringAndSize(
+            (char *) self->buf + m->offset + m->key_len, m->value_len);
+    }
+
+    Py_ssize_t size = builder_encoded_size(self);
+    if(size > 0xffff) {
+        PyErr_SetString(PyExc_ValueError, "batch too large.");
+        return NULL;
+    }
+
+    PyObject *out = PyString_FromStringAndSize(NULL, size);
+    if(! out) {
+        return NULL;
+    }
+
+    uint8_t *p = (uint8_t *) PyString_AS_STRING(out);
+    Py_ssize_t pos = (2 * n) + 6;
+    write_u16(p, n);
+    p[pos - 2] = 0;
+    p[pos - 1] = 0;
+
+    Py_ssize_t i;
+    for(i = 0; i < n; i++) {
+        struct member *m = &self->members[i];
+        Py_ssize_t suffix_len = m->key_len - self->cp_len;
+        if(suffix_len > 255) {
+            Py_DECREF(out);
+            PyErr_SetString(PyExc_ValueError, "batch key suffix too long.");
+            return NULL;
+        }
+        write_u16(p + 2 + (2 * i), pos);
+        p[pos++] = (uint8_t) suffix_len;
+        memcpy(p + pos, self->buf + m->offset + self->cp_len,
+               suffix_len + m->value_len);
+        pos += suffix_len + m->value_len;
+    }
+    write_u16(p + 2 + (2 * n), pos);
+    assert(pos == size);
+    return out;
+}
+
+
+static PySequenceMethods builder_seq_methods = {
+    .sq_length = (lenfunc) builder_len
+};
+
+static PyMethodDef builder_methods[] = {
+    {"append", (PyCFunction)builder_append, METH_VARARGS, ""},
+    {"pop", (PyCFunction)builder_pop, METH_NOARGS, ""},
+    {"clear", (PyCFunction)builder_clear, METH_NOARGS, ""},
+    {"keys", (PyCFunction)builder_keys, METH_NOARGS, ""},
+    {"size", (PyCFunction)builder_size, METH_NOARGS, ""},
+    {"build", (PyCFunction)builder_build, METH_NOARGS, ""},
+    {0, 0, 0, 0}
+};
+
+static PyTypeObject BatchV2BuilderType = {
+    PyObject_HEAD_INIT(NULL)
+    .tp_new = builder_new,
+    .tp_dealloc = (destructor) builder_dealloc,
+    .tp_name = "acid._iterators.BatchV2Builder",
+    .tp_basicsize = sizeof(BatchV2Builder),
+    .tp_as_sequence = &builder_seq_methods,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_doc = "acid._iterators.BatchV2Builder",
+    .tp_methods = builder_methods
+};
+
+
+/**
+ * Do all required to initialize the BatchV2Builder type, and return a
+ * borrowed reference to it.
+ */
+PyTypeObject *
+acid_init_batch_builder_type(void)
+{
+    if(PyType_Ready(&BatchV2BuilderType)) {
+        return NULL;
+    }
+    return &BatchV2BuilderType;
+}
@@ -0,0 +1,553 @@
+/*
+ * Copyright 2013, David Wilson.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy
+ * of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ */
+
+/*
+ * LZ4 block and Snappy raw format compressors. Input is read using the buffer
+ * protocol, so batch values may be decompressed directly from the storage
+ * engine's buffer.
+ */
+
+#include "acid.h"
+
+#include <string.h>
+
+
+/** log2 of the number of match candidate slots. */
+#define HASH_BITS 14
+/** Shortest match either format can encode. */
+#define MIN_MATCH 4
+/** Furthest match distance either format can encode using 2 bytes. */
+#define MAX_OFFSET 65535
+/** LZ4: the final match must start this many bytes before the input end. */
+#define LZ4_MFLIMIT 12
+/** LZ4: the final bytes of input that are always literals. */
+#define LZ4_LASTLITERALS 5
+/** LZ4: most output bytes a single input byte can produce. */
+#define LZ4_MAX_EXPANSION 255
+/** Snappy: most output bytes a single input byte can produce. */
+#define SNAPPY_MAX_EXPANSION 22
+
+
+static uint32_t
+read_u32(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof v);
+    return v;
+}
+
+static uint32_t
+hash_u32(uint32_t v)
+{
+    return (v * 2654435761U) >> (32 - HASH_BITS);
+}
+
+/**
+ * Return the length of the match between `p` and `q`, stopping before `e`.
+ */
+static Py_ssize_t
+match_len(const uint8_t *p, const uint8_t *q, const uint8_t *e)
+{
+    const uint8_t *start = q;
+    while(q < e && *p == *q) {
+        p++;
+        q++;
+    }
+    return q - start;
+}
+
+/**
+ * Write `v` as an unsigned little endian base 128 varint, returning the new
+ * output position.
+ */
+static uint8_t *
+write_varint(uint8_t *o, uint64_t v)
+{
+    while(v >= 0x80) {
+        *o++ = (uint8_t) (v | 0x80);
+        v >>= 7;
+    }
+    *o++ = (uint8_t) v;
+    return o;
+}
+
+/**
+ * Read an unsigned little endian base 128 varint from `rdr`, returning -1 on
+ * error.
+ */
+static int
+read_varint(Slice *rdr, uint64_t *v)
+{
+    int shift;
+    *v = 0;
+    for(shift = 0; shift < 64 && rdr->p < rdr->e; shift += 7) {
+        uint8_t c = *rdr->p++;
+        *v |= ((uint64_t) (c & 0x7f)) << shift;
+        if(! (c & 0x80)) {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Resize `out` to `len` bytes, returning -1 on error.
+ */
+static int
+finish_output(PyObject **out, uint8_t *o)
+{
+    Py_ssize_t len = o - (uint8_t *) PyString_AS_STRING(*out);
+    return _PyString_Resize(out, len);
+}
+
+static PyObject *
+corrupt(const char *format)
+{
+    PyErr_Format(PyExc_ValueError, "corrupt %s input.", format);
+    return NULL;
+}
+
+
+// ---
+// LZ4
+// ---
+
+/**
+ * Write an LZ4 length continuation for `len`.
+ */
+static uint8_t *
+lz4_write_len(uint8_t *o, Py_ssize_t len)
+{
+    while(len >= 255) {
+        *o++ = 255;
+        len -= 255;
+    }
+    *o++ = (uint8_t) len;
+    return o;
+}
+
+/**
+ * Write an LZ4 sequence of `lit_len` literals from `lit`, followed by a match
+ * of `mlen` bytes at distance `offset`, or no match if `mlen` is 0.
+ */
+static uint8_t *
+lz4_write_seq(uint8_t *o, const uint8_t *lit, Py_ssize_t lit_len,
+              Py_ssize_t offset, Py_ssize_t mlen)
+{
+    uint8_t *token = o++;
+    *token = (uint8_t) (((lit_len < 15) ? lit_len : 15) << 4);
+    if(lit_len >= 15) {
+        o = lz4_write_len(o, lit_len - 15);
+    }
+    memcpy(o, lit, lit_len);
+    o += lit_len;
+    if(mlen) {
+        *o++ = (uint8_t) offset;
+        *o++ = (uint8_t) (offset >> 8);
+        mlen -= MIN_MATCH;
+        *token |= (uint8_t) ((mlen < 15) ? mlen : 15);
+        if(mlen >= 15) {
+            o = lz4_write_len(o, mlen - 15);
+        }
+    }
+    return o;
+}
+
+/**
+ * lz4_compress(data) -> str.
+ */
+static PyObject *
+py_lz4_compress(PyObject *self, PyObject *args)
+{
+    PyObject *data;
+    Slice in;
+    if(! PyArg_ParseTuple(args, "O", &data) || acid_make_reader(&in, data)) {
+        return NULL;
+    }
+
+    Py_ssize_t len = in.e - in.p;
+    PyObject *out = PyString_FromStringAndSize(NULL,
+        10 + len + (len / 255) + 16);
+    uint32_t *table = PyMem_Malloc(sizeof(uint32_t) << HASH_BITS);
+    if(! (out && table)) {
+        Py_XDECREF(out);
+        PyMem_Free(table);
+        return PyErr_NoMemory();
+    }
+    memset(table, 0xff, sizeof(uint32_t) << HASH_BITS);
+
+    uint8_t *o = write_varint((uint8_t *) PyString_AS_STRING(out), len);
+    const uint8_t *base = in.p;
+    const uint8_t *lit = in.p;
+    const uint8_t *p = in.p;
+    // Short inputs are all literals; avoid forming pointers before `in.p`.
+    const uint8_t *limit = in.p;
+    const uint8_t *match_end = in.p;
+    if(len >= LZ4_MFLIMIT) {
+        limit = in.e - LZ4_MFLIMIT;
+        match_end = in.e - LZ4_LASTLITERALS;
+    }
+
+    while(p < limit) {
+        uint32_t h = hash_u32(read_u32(p));
+        uint32_t cand = table[h];
+        table[h] = (uint32_t) (p - base);
+        if(cand != 0xffffffff
+           && (p - base) - cand <= MAX_OFFSET
+           && read_u32(base + cand) == read_u32(p)) {
+            const uint8_t *q = base + cand;
+            Py_ssize_t mlen = MIN_MATCH + match_len(q + MIN_MATCH,
+                                                    p + MIN_MATCH, match_end);
+            o = lz4_write_seq(o, lit, p - lit, p - q, mlen);
+            p += mlen;
+            lit = p;
+        } else {
+            p++;
+        }
+    }
+    o = lz4_write_seq(o, lit, in.e - lit, 0, 0);
+    PyMem_Free(table);
+
+    if(finish_output(&out, o)) {
+        return NULL;
+    }
+    return out;
+}
+
+/**
+ * Read an LZ4 length continuation, adding it to `len`.
+ */
+static int
+lz4_read_len(Slice *rdr, Py_ssize_t *len)
+{
+    uint8_t c;
+    do {
+        if(rdr->p >= rdr->e) {
+            return -1;
+        }
+        c = *rdr->p++;
+        *len += c;
+    } while(c == 255);
+    return 0;
+}
+
+/**
+ * lz4_decompress(data) -> str.
+ */
+static PyObject *
+py_lz4_decompress(PyObject *self, PyObject *args)
+{
+    PyObject *data;
+    Slice rdr;
+    uint64_t size;
+    if(! PyArg_ParseTuple(args, "O", &data) || acid_make_reader(&rdr, data)) {
+        return NULL;
+    }
+    // Reject sizes the input could not produce before allocating them.
+    if(read_varint(&rdr, &size) || size > PY_SSIZE_T_MAX
+       || size > (uint64_t) (rdr.e - rdr.p) * LZ4_MAX_EXPANSION) {
+        return corrupt("LZ4");
+    }
+
+    PyObject *out = PyString_FromStringAndSize(NULL, (Py_ssize_t) size);
+    if(! out) {
+        return NULL;
+    }
+    uint8_t *start = (uint8_t *) PyString_AS_STRING(out);
+    uint8_t *o = start;
+    uint8_t *oe = start + size;
+
+    while(rdr.p < rdr.e) {
+        uint8_t token = *rdr.p++;
+        Py_ssize_t lit_len = token >> 4;
+        if(lit_len == 15 && lz4_read_len(&rdr, &lit_len)) {
+            goto corrupt;
+        }
+        if(lit_len > (rdr.e - rdr.p) || lit_len > (oe - o)) {
+            goto corrupt;
+        }
+        memcpy(o, rdr.p, lit_len);
+        o += lit_len;
+        rdr.p += lit_len;
+        if(rdr.p == rdr.e) {
+            break;
+        }
+
+        if((rdr.e - rdr.p) < 2) {
+            goto corrupt;
+        }
+        Py_ssize_t offset = rdr.p[0] | (rdr.p[1] << 8);
+        rdr.p += 2;
+        Py_ssize_t mlen = token & 15;
+        if(mlen == 15 && lz4_read_len(&rdr, &mlen)) {
+            goto corrupt;
+        }
+        mlen += MIN_MATCH;
+        if(! offset || offset > (o - start) || mlen > (oe - o)) {
+            goto corrupt;
+        }
+        // Matches may overlap their own output, so copy bytewise.
+        uint8_t *q = o - offset;
+        while(mlen--) {
+            *o++ = *q++;
+        }
+    }
+    if(o != oe) {
+        goto corrupt;
+    }
+    return out;
+
+corrupt:
+    Py_DECREF(out);
+    return corrupt("LZ4");
+}
+
+
+// ------
+// Snappy
+// ------
+
+/**
+ * Write a Snappy literal element of `len` bytes from `lit`.
+ */
+static uint8_t *
+snappy_write_literal(uint8_t *o, const uint8_t *lit, Py_ssize_t len)
+{
+    Py_ssize_t n = len - 1;
+    if(n < 60) {
+        *o++ = (uint8_t) (n << 2);
+    } else {
+        uint8_t *tag = o++;
+        int count = 0;
+        while(n) {
+            *o++ = (uint8_t) n;
+            n >>= 8;
+            count++;
+        }
+        *tag = (uint8_t) ((59 + count) << 2);
+    }
+    memcpy(o, lit, len);
+    return o + len;
+}
+
+/**
+ * Write Snappy copy elements for a match of `len` bytes at `offset`.
+ */
+static uint8_t *
+snappy_write_copy(uint8_t *o, Py_ssize_t offset, Py_ssize_t len)
+{
+    // Leave at least 4 bytes for the final element of long matches.
+    while(len >= 68) {
+        *o++ = (uint8_t) ((63 << 2) | 2);
+        *o++ = (uint8_t) offset;
+        *o++ = (uint8_t) (offset >> 8);
+        len -= 64;
+    }
+    if(len > 64) {
+        *o++ = (uint8_t) ((59 << 2) | 2);
+        *o++ = (uint8_t) offset;
+        *o++ = (uint8_t) (offset >> 8);
+        len -= 60;
+    }
+    if(len < 12 && offset < 2048) {
+        *o++ = (uint8_t) (((offset >> 8) << 5) | ((len - 4) << 2) | 1);
+        *o++ = (uint8_t) offset;
+    } else {
+        *o++ = (uint8_t) (((len - 1) << 2) | 2);
+        *o++ = (uint8_t) offset;
+        *o++ = (uint8_t) (offset >> 8);
+    }
+    return o;
+}
+
+/**
+ * snappy_compress(data) -> str.
+ */
+static PyObject *
+py_snappy_compress(PyObject *self, PyObject *args)
+{
+    PyObject *data;
+    Slice in;
+    if(! PyArg_ParseTuple(args, "O", &data) || acid_make_reader(&in, data)) {
+        return NULL;
+    }
+
+    Py_ssize_t len = in.e - in.p;
+    PyObject *out = PyString_FromStringAndSize(NULL, 32 + len + (len / 6));
+    uint32_t *table = PyMem_Malloc(sizeof(uint32_t) << HASH_BITS);
+    if(! (out && table)) {
+        Py_XDECREF(out);
+        PyMem_Free(table);
+        return PyErr_NoMemory();
+    }
+    memset(table, 0xff, sizeof(uint32_t) << HASH_BITS);
+
+    uint8_t *o = write_varint((uint8_t *) PyString_AS_STRING(out), len);
+    const uint8_t *base = in.p;
+    const uint8_t *lit = in.p;
+    const uint8_t *p = in.p;
+    const uint8_t *limit = (len >= MIN_MATCH) ? (in.e - MIN_MATCH) : in.p;
+
+    while(p < limit) {
+        uint32_t h = hash_u32(read_u32(p));
+        uint32_t cand = table[h];
+        table[h] = (uint32_t) (p - base);
+        if(cand != 0xffffffff
+           && (p - base) - cand <= MAX_OFFSET
+           && read_u32(base + cand) == read_u32(p)) {
+            const uint8_t *q = base + cand;
+            Py_ssize_t mlen = MIN_MATCH + match_len(q + MIN_MATCH,
+                                                    p + MIN_MATCH, in.e);
+            if(p > lit) {
+                o = snappy_write_literal(o, lit, p - lit);
+            }
+            o = snappy_write_copy(o, p - q, mlen);
+            p += mlen;
+            lit = p;
+        } else {
+            p++;
+        }
+    }
+    if(in.e > lit) {
+        o = snappy_write_literal(o, lit, in.e - lit);
+    }
+    PyMem_Free(table);
+
+    if(finish_output(&out, o)) {
+        return NULL;
+    }
+    return out;
+}
+
+/**
+ * snappy_decompress(data) -> str.
+ */
+static PyObject *
+py_snappy_decompress(PyObject *self, PyObject *args)
+{
+    PyObject *data;
+    Slice rdr;
+    uint64_t size;
+    if(! PyArg_ParseTuple(args, "O", &data) || acid_make_reader(&rdr, data)) {
+        return NULL;
+    }
+    // Reject sizes the input could not produce before allocating them.
+    if(read_varint(&rdr, &size) || size > PY_SSIZE_T_MAX
+       || size > (uint64_t) (rdr.e - rdr.p) * SNAPPY_MAX_EXPANSION) {
+        return corrupt("Snappy");
+    }
+
+    PyObject *out = PyString_FromStringAndSize(NULL, (Py_ssize_t) size);
+    if(! out) {
+        return NULL;
+    }
+    uint8_t *start = (uint8_t *) PyString_AS_STRING(out);
+    uint8_t *o = start;
+    uint8_t *oe = start + size;
+
+    while(rdr.p < rdr.e) {
+        uint8_t tag = *rdr.p++;
+        Py_ssize_t len;
+        Py_ssize_t offset;
+        int i;
+
+        switch(tag & 3) {
+        case 0:
+            len = tag >> 2;
+            if(len >= 60) {
+                int count = len - 59;
+                if((rdr.e - rdr.p) < count) {
+                    goto corrupt;
+                }
+                len = 0;
+                for(i = 0; i < count; i++) {
+                    len |= ((Py_ssize_t) *rdr.p++) << (8 * i);
+                }
+            }
+            len++;
+            if(len > (rdr.e - rdr.p) || len > (oe - o)) {
+                goto corrupt;
+            }
+            memcpy(o, rdr.p, len);
+            o += len;
+            rdr.p += len;
+            continue;
+        case 1:
+            if(rdr.p >= rdr.e) {
+                goto corrupt;
+            }
+            len = 4 + ((tag >> 2) & 7);
+            offset = ((tag >> 5) << 8) | *rdr.p++;
+            break;
+        case 2:
+            if((rdr.e - rdr.p) < 2) {
+                goto corrupt;
+            }
+            len = 1 + (tag >> 2);
+            offset = rdr.p[0] | (rdr.p[1] << 8);
+            rdr.p += 2;
+            break;
+        default:
+            if((rdr.e - rdr.p) < 4) {
+                goto corrupt;
+            }
+            len = 1 + (tag >> 2);
+            offset = 0;
+            for(i = 3; i >= 0; i--) {
+                offset = (offset << 8) | rdr.p[i];
+            }
+            rdr.p += 4;
+            break;
+        }
+
+        if(! offset || offset > (o - start) || len > (oe - o)) {
+            goto corrupt;
+        }
+        uint8_t *q = o - offset;
+        while(len--) {
+            *o++ = *q++;
+        }
+    }
+    if(o != oe) {
+        goto corrupt;
+    }
+    return out;
+
+corrupt:
+    Py_DECREF(out);
+    return corrupt("Snappy");
+}
+
+
+static PyMethodDef EncodersMethods[] = {
+    {"lz4_compress", py_lz4_compress, METH_VARARGS, "lz4_compress"},
+    {"lz4_decompress", py_lz4_decompress, METH_VARARGS, "lz4_decompress"},
+    {"snappy_compress", py_snappy_compress, METH_VARARGS, "snappy_compress"},
+    {"snappy_decompress", py_snappy_decompress, METH_VARARGS,
+        "snappy_decompress"},
+    {NULL, NULL, 0, NULL}
+};
+
+
+/**
+ * Initialize the acid._encoders module.
+ */
+int
+acid_init_encoders_module(void)
+{
+    PyObject *mod = acid_init_module("_encoders", EncodersMethods);
+    return mod ? 0 : -1;
+}
@@ -29,7 +29,87 @@
 #include <time.h>
 
 
-PyObject *log_exception;
+PyObject *log_error;
+
+
+/**
+ * Log the exception raised by `func(*args)` and remove `func` from `lst`, which
+ * is expected to be found at index `i`. Returns 0 on success or -1 on error.
+ */
+static int
+dispatch_remove(PyObject *lst, Py_ssize_t i, PyObject *func, PyObject *args)
+{
+    if(PyErr_Occurred()) {
+        // logging can't see a pending C exception, so pass it as exc_info=.
+        PyObject *type, *value, *tb;
+        PyErr_Fetch(&type, &value, &tb);
+        PyErr_NormalizeException(&type, &value, &tb);
+        PyObject *exc_info = Py_BuildValue("(OOO)", type,
+            value ? value : Py_None, tb ? tb : Py_None);
+        Py_XDECREF(type);
+        Py_XDECREF(value);
+        Py_XDECREF(tb);
+        if(! exc_info) {
+            return -1;
+        }
+
+        PyObject *kwds = Py_BuildValue("{sN}", "exc_info", exc_info);
+        PyObject *fargs = kwds ? Py_BuildValue("(sOO)", "While invoking %r%r",
+                                               func, args) : NULL;
+        PyObject *ret = fargs ? PyObject_Call(log_error, fargs, kwds) : NULL;
+        Py_XDECREF(kwds);
+        Py_XDECREF(fargs);
+        if(! ret) {
+            return -1;
+        }
+        Py_DECREF(ret);
+    }
+
+    // The listener may have mutated the list during the call.
+    if(i >= PyList_GET_SIZE(lst) || PyList_GET_ITEM(lst, i) != func) {
+        return 0;
+    }
+    return PyList_SetSlice(lst, i, i + 1, NULL);
+}
+
+
+/**
+ * Invoke each `func` in `lst` as `func(*args)`, in reverse order, removing any
+ * that raise Exception or return False. Other exceptions, like
+ * KeyboardInterrupt, are propagated. Returns 0 on success or -1 on error.
+ */
+static int
+dispatch_list(PyObject *lst, PyObject *args)
+{
+    Py_ssize_t i;
+    for(i = PyList_GET_SIZE(lst) - 1; i >= 0; i--) {
+        if(i >= PyList_GET_SIZE(lst)) {
+            continue;
+        }
+        PyObject *func = PyList_GET_ITEM(lst, i);
+        Py_INCREF(func);
+        PyObject *ret = PyObject_Call(func, args, NULL);
+        int rc = 0;
+        if(! ret) {
+            // Like dispatch(), only Exception subclasses are logged.
+            if(! PyErr_ExceptionMatches(PyExc_Exception)) {
+                Py_DECREF(func);
+                return -1;
+            }
+            rc = dispatch_remove(lst, i, func, args);
+        } else {
+            if(ret == Py_False) {
+                rc = dispatch_remove(lst, i, func, args);
+            }
+            Py_DECREF(ret);
+        }
+        Py_DECREF(func);
+        if(rc) {
+            return -1;
+        }
+    }
+    return 0;
+}
 
 
 /**
@@ -44,63 +124,62 @@ py_dispatch(PyObject *self, PyObject *args)
     }
 
     PyObject *lst = PyTuple_GET_ITEM(args, 0);
-    if(! PyList_CheckExact(lst)) {
+    if(! PyList_Check(lst)) {
         PyErr_SetString(PyExc_TypeError, "dispatch() first argument must be list.");
         return NULL;
     }
 
+    if(! PyList_GET_SIZE(lst)) {
+        Py_RETURN_NONE;
+    }
+
     PyObject *fargs = PyTuple_GetSlice(args, 1, PyTuple_GET_SIZE(args));
     if(! fargs) {
         return NULL;
     }
 
-    Py_ssize_t i;
-    PyObject *out = NULL;
-    for(i = PyList_GET_SIZE(lst) - 1; i >= 0; i--) {
-        PyObject *func = PyList_GET_ITEM(lst, i);
-        PyObject *ret = PyObject_CallObject(func, fargs);
-        if(ret) {
-            Py_DECREF(ret);
-        } else {
-            PyObject *func_repr = PyObject_Repr(func);
-            PyObject *fargs_repr = PyObject_Repr(fargs);
-            if(! (func_repr && fargs_repr)) {
-                Py_CLEAR(func_repr);
-                Py_CLEAR(fargs_repr);
-                goto argh;
-            }
-            PyObject *msg = PyString_FromFormat(
-                "While invoking %s(*%s)",
-                PyString_AS_STRING(func_repr),
-                PyString_AS_STRING(fargs_repr));
-            Py_DECREF(func_repr);
-            Py_DECREF(fargs_repr);
-            if(! msg) {
-                goto argh;
-            }
-            ret = PyObject_CallFunctionObjArgs(log_exception, msg, NULL);
-            Py_DECREF(msg);
-            if(! ret) {
-                goto argh;
-            }
-            PyErr_Clear();
-            Py_DECREF(ret);
-            if(PyList_SetSlice(lst, i-1, i, NULL)) {
-                goto argh;
-            }
-        }
+    int rc = dispatch_list(lst, fargs);
+    Py_DECREF(fargs);
+    if(rc) {
+        return NULL;
     }
+    Py_RETURN_NONE;
+}
 
-    out = Py_None;
-    Py_INCREF(out);
-argh:
-    Py_DECREF(fargs);
-    return out;
+
+/**
+ * acid._core.Dispatcher.__call__(*args). The argument tuple is passed through
+ * to each listener unmodified, and nothing is done if the list is empty.
+ */
+static PyObject *
+dispatcher_call(PyObject *self, PyObject *args, PyObject *kwds)
+{
+    if(PyList_GET_SIZE(self)) {
+        if(kwds && PyDict_Size(kwds)) {
+            PyErr_SetString(PyExc_TypeError,
+                "Dispatcher() takes no keyword arguments.");
+            return NULL;
+        }
+        if(dispatch_list(self, args)) {
+            return NULL;
+        }
+    }
+    Py_RETURN_NONE;
 }
 
 
+static PyTypeObject DispatcherType = {
+    PyObject_HEAD_INIT(NULL)
+    .tp_name = "acid._core.Dispatcher",
+    .tp_basicsize = sizeof(PyListObject),
+    .tp_call = dispatcher_call,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_doc = "acid._core.Dispatcher"
+};
+
+
 /**
- * Table of functions exported in the acid._keylib module.
+ * Table of functions exported in the acid._core module.
  */
 static PyMethodDef CoreMethods[] = {
     {"dispatch", py_dispatch, METH_VARARGS, "dispatch"},
@@ -125,12 +204,24 @@ acid_init_core_module(void)
         return -1;
     }
 
-    log_exception = PyObject_GetAttrString(logger, "exception");
+    log_error = PyObject_GetAttrString(logger, "error");
     Py_DECREF(logger);
-    if(! log_exception) {
+    if(! log_error) {
+        return -1;
+    }
+
+    DispatcherType.tp_base = &PyList_Type;
+    if(PyType_Ready(&DispatcherType)) {
         return -1;
     }
 
     PyObject *mod = acid_init_module("_core", CoreMethods);
-    return mod ? 0 : -1;
+    if(! mod) {
+        return -1;
+    }
+
+    if(PyModule_AddObject(mod, "Dispatcher", (PyObject *) &DispatcherType)) {
+        return -1;
+    }
+    return 0;
 }
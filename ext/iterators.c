@@ -647,6 +647,10 @@ acid_init_iterators_module(void)
     if(PyType_Ready(&BasicIteratorType)) {
         return -1;
     }
+    PyTypeObject *builder_type = acid_init_batch_builder_type();
+    if(! builder_type) {
+        return -1;
+    }
 
     PyObject *mod = acid_init_module("_iterators", /*IteratorsMethods*/0);
     if(! mod) {
@@ -659,6 +663,9 @@ acid_init_iterators_module(void)
     if(PyModule_AddObject(mod, "BasicIterator", (PyObject *) &BasicIteratorType)) {
         return -1;
     }
+    if(PyModule_AddObject(mod, "BatchV2Builder", (PyObject *) builder_type)) {
+        return -1;
+    }
 
     return 0;
 }
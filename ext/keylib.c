@@ -1139,6 +1139,114 @@ static PyObject *py_decode_offsets(PyObject *self, PyObject *args)
     return tmp;
 }
 
+/**
+ * Compare the bytestrings `a` and `b` like memcmp(), with shorter strings
+ * sorting first when one is a prefix of the other.
+ */
+static int
+compare_strings(PyObject *a, PyObject *b)
+{
+    Py_ssize_t a_len = PyString_GET_SIZE(a);
+    Py_ssize_t b_len = PyString_GET_SIZE(b);
+    int cmp = memcmp(PyString_AS_STRING(a), PyString_AS_STRING(b),
+                     (a_len < b_len) ? a_len : b_len);
+    if(! cmp) {
+        cmp = (a_len > b_len) - (a_len < b_len);
+    }
+    return cmp;
+}
+
+/**
+ * Return the index of the first element of `lst` following `i` that differs
+ * from the element at `i`.
+ */
+static Py_ssize_t
+skip_equal(PyObject *lst, Py_ssize_t i)
+{
+    PyObject *x = PyList_GET_ITEM(lst, i);
+    Py_ssize_t len = PyList_GET_SIZE(lst);
+    for(i++; i < len && ! compare_strings(x, PyList_GET_ITEM(lst, i)); i++);
+    return i;
+}
+
+/**
+ * Return 0 if every element of `lst` is a bytestring, otherwise set an
+ * exception and return -1.
+ */
+static int
+check_strings(PyObject *lst)
+{
+    for(Py_ssize_t i = 0; i < PyList_GET_SIZE(lst); i++) {
+        if(! PyString_CheckExact(PyList_GET_ITEM(lst, i))) {
+            PyErr_SetString(PyExc_TypeError,
+                "sorted_diff() requires lists of bytestrings.");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Python-level function to compute the distinct elements present in only one
+ * of two sorted lists of bytestrings. Used to limit index maintenance to the
+ * entries that changed.
+ */
+static PyObject *py_sorted_diff(PyObject *self, PyObject *args)
+{
+    PyObject *old;
+    PyObject *new;
+    if(! PyArg_ParseTuple(args, "O!O!", &PyList_Type, &old,
+                          &PyList_Type, &new)) {
+        return NULL;
+    }
+    if(check_strings(old) || check_strings(new)) {
+        return NULL;
+    }
+
+    PyObject *removed = PyList_New(0);
+    PyObject *added = PyList_New(0);
+    if(! (removed && added)) {
+        goto fail;
+    }
+
+    Py_ssize_t old_len = PyList_GET_SIZE(old);
+    Py_ssize_t new_len = PyList_GET_SIZE(new);
+    Py_ssize_t i = 0;
+    Py_ssize_t j = 0;
+    while(i < old_len || j < new_len) {
+        int cmp;
+        if(i == old_len) {
+            cmp = 1;
+        } else if(j == new_len) {
+            cmp = -1;
+        } else {
+            cmp = compare_strings(PyList_GET_ITEM(old, i),
+                                  PyList_GET_ITEM(new, j));
+        }
+
+        if(cmp < 0) {
+            if(PyList_Append(removed, PyList_GET_ITEM(old, i))) {
+                goto fail;
+            }
+            i = skip_equal(old, i);
+        } else if(cmp > 0) {
+            if(PyList_Append(added, PyList_GET_ITEM(new, j))) {
+                goto fail;
+            }
+            j = skip_equal(new, j);
+        } else {
+            i = skip_equal(old, i);
+            j = skip_equal(new, j);
+        }
+    }
+    return Py_BuildValue("(NN)", removed, added);
+
+fail:
+    Py_XDECREF(removed);
+    Py_XDECREF(added);
+    return NULL;
+}
+
 /**
  * Table of functions exported in the acid._keylib module.
  */
@@ -1149,6 +1257,7 @@ static PyMethodDef KeylibMethods[] = {
     {"packs", py_packs, METH_VARARGS, "packs"},
     {"pack_int", py_pack_int, METH_VARARGS, "pack_int"},
     {"decode_offsets", py_decode_offsets, METH_VARARGS, "decode_offsets"},
+    {"sorted_diff", py_sorted_diff, METH_VARARGS, "sorted_diff"},
     {NULL, NULL, 0, NULL}
 };
 
@@ -0,0 +1,1032 @@
+/*
+ * Copyright 2013, David Wilson.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy
+ * of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ */
+
+#include "acid.h"
+
+#include <string.h>
+
+
+/** Wire types; see acid/structlib.py. */
+enum WireType {
+    WIRE_TYPE_VARIABLE = 0,
+    WIRE_TYPE_64 = 1,
+    WIRE_TYPE_DELIMITED = 2,
+    WIRE_TYPE_32 = 5
+};
+
+/**
+ * Field kinds encoded without calling the field's coder. Must match
+ * structlib.NATIVE_KINDS.
+ */
+enum NativeKind {
+    NATIVE_NONE = 0,
+    NATIVE_VARINT,
+    NATIVE_UVARINT,
+    NATIVE_SVARINT,
+    NATIVE_BOOL,
+    NATIVE_DOUBLE,
+    NATIVE_FLOAT,
+    NATIVE_I32,
+    NATIVE_I64,
+    NATIVE_U32,
+    NATIVE_U64,
+    NATIVE_BLOB,
+    NATIVE_TEXT
+};
+
+/** Maximum encoded size of a varint. */
+#define VARINT_MAX 10
+
+/** Interned "_buf" and "_offsets" attribute names of structlib.Struct. */
+static PyObject *buf_str;
+static PyObject *offsets_str;
+/** Key of structlib.Struct._offsets holding the offset scanning resumes at. */
+static PyObject *resume_key;
+
+
+/**
+ * Like acid_make_reader(), but additionally accept memoryview, as used by
+ * structlib._PackedCoder.
+ */
+static int
+make_reader(Slice *slice, PyObject *buf)
+{
+    if(PyMemoryView_Check(buf)) {
+        Py_buffer *view = PyMemoryView_GET_BUFFER(buf);
+        slice->p = view->buf;
+        slice->e = slice->p + view->len;
+        return 0;
+    }
+    return acid_make_reader(slice, buf);
+}
+
+/**
+ * Set an exception describing truncated input and return -1.
+ */
+static int
+truncated(void)
+{
+    PyErr_SetString(PyExc_ValueError, "struct data truncated.");
+    return -1;
+}
+
+/**
+ * Read a varint from `s`, storing it in `*out`. Return 0 on success, or set an
+ * exception and return -1.
+ */
+static int
+read_varint(Slice *s, uint64_t *out)
+{
+    uint64_t v = 0;
+    int shift = 0;
+    while(s->p < s->e) {
+        uint8_t ch = *s->p++;
+        v |= ((uint64_t) (ch & 0x7f)) << shift;
+        if(ch < 0x80) {
+            *out = v;
+            return 0;
+        }
+        shift += 7;
+        if(shift >= 64) {
+            break;
+        }
+    }
+    return truncated();
+}
+
+/**
+ * Return a Python int for `v`, or a long if it does not fit.
+ */
+static PyObject *
+from_i64(int64_t v)
+{
+    if(v >= LONG_MIN && v <= LONG_MAX) {
+        return PyInt_FromLong((long) v);
+    }
+    return PyLong_FromLongLong(v);
+}
+
+/**
+ * Return a Python int for `v`, or a long if it does not fit.
+ */
+static PyObject *
+from_u64(uint64_t v)
+{
+    if(v <= LONG_MAX) {
+        return PyInt_FromLong((long) v);
+    }
+    return PyLong_FromUnsignedLongLong(v);
+}
+
+/**
+ * Convert the int or long `o` to its 64 bit two's complement representation,
+ * as structlib.write_varint() does. Return 0 on success, or set an exception
+ * and return -1.
+ */
+static int
+to_u64(PyObject *o, uint64_t *out)
+{
+    if(PyInt_Check(o)) {
+        *out = (uint64_t) (int64_t) PyInt_AS_LONG(o);
+        return 0;
+    }
+    if(! PyLong_Check(o)) {
+        PyErr_Format(PyExc_TypeError, "integer required, not %s",
+                     Py_TYPE(o)->tp_name);
+        return -1;
+    }
+    if(_PyLong_Sign(o) < 0) {
+        PY_LONG_LONG v = PyLong_AsLongLong(o);
+        if(v == -1 && PyErr_Occurred()) {
+            return -1;
+        }
+        *out = (uint64_t) v;
+        return 0;
+    }
+    unsigned PY_LONG_LONG v = PyLong_AsUnsignedLongLong(o);
+    if(v == (unsigned PY_LONG_LONG) -1 && PyErr_Occurred()) {
+        PyErr_SetString(PyExc_ValueError, "value too large.");
+        return -1;
+    }
+    *out = v;
+    return 0;
+}
+
+/**
+ * Read `n` little endian bytes from `s` into `*out`. Return 0 on success, or
+ * set an exception and return -1.
+ */
+static int
+read_le(Slice *s, int n, uint64_t *out)
+{
+    if((s->e - s->p) < n) {
+        return truncated();
+    }
+    uint64_t v = 0;
+    for(int i = n - 1; i >= 0; i--) {
+        v = (v << 8) | s->p[i];
+    }
+    s->p += n;
+    *out = v;
+    return 0;
+}
+
+/**
+ * Skip a value of wire type `wire_type` in `s`. Return 0 on success, or set an
+ * exception and return -1.
+ */
+static int
+skip_value(Slice *s, int wire_type)
+{
+    uint64_t n;
+    switch(wire_type) {
+    case WIRE_TYPE_VARIABLE:
+        return read_varint(s, &n);
+    case WIRE_TYPE_64:
+        n = 8;
+        break;
+    case WIRE_TYPE_DELIMITED:
+        if(read_varint(s, &n)) {
+            return -1;
+        }
+        break;
+    case WIRE_TYPE_32:
+        n = 4;
+        break;
+    default:
+        PyErr_SetString(PyExc_IOError, "cannot skip unrecognized WIRE_TYPE");
+        return -1;
+    }
+    if((uint64_t) (s->e - s->p) < n) {
+        return truncated();
+    }
+    s->p += n;
+    return 0;
+}
+
+/**
+ * Read the delimited value from `s`, storing its start in `*p` and length in
+ * `*len`. Return 0 on success, or set an exception and return -1.
+ */
+static int
+read_delimited(Slice *s, uint8_t **p, Py_ssize_t *len)
+{
+    uint64_t n;
+    if(read_varint(s, &n)) {
+        return -1;
+    }
+    if((uint64_t) (s->e - s->p) < n) {
+        return truncated();
+    }
+    *p = s->p;
+    *len = (Py_ssize_t) n;
+    s->p += n;
+    return 0;
+}
+
+/**
+ * Decode a scalar value of kind `native` from `s`. Return a new reference, or
+ * set an exception and return NULL.
+ */
+static PyObject *
+read_native(Slice *s, int native)
+{
+    uint64_t u;
+    uint8_t *p;
+    Py_ssize_t len;
+
+    switch(native) {
+    case NATIVE_VARINT:
+        if(read_varint(s, &u)) {
+            return NULL;
+        }
+        return from_i64((int64_t) u);
+    case NATIVE_UVARINT:
+        if(read_varint(s, &u)) {
+            return NULL;
+        }
+        return from_u64(u);
+    case NATIVE_SVARINT:
+        if(read_varint(s, &u)) {
+            return NULL;
+        }
+        return from_i64((int64_t) ((u >> 1) ^ -(u & 1)));
+    case NATIVE_BOOL:
+        if(s->p >= s->e) {
+            truncated();
+            return NULL;
+        }
+        return PyBool_FromLong(*s->p++ == 1);
+    case NATIVE_DOUBLE: {
+        double d;
+        if((s->e - s->p) < (Py_ssize_t) sizeof d) {
+            truncated();
+            return NULL;
+        }
+        memcpy(&d, s->p, sizeof d);
+        s->p += sizeof d;
+        return PyFloat_FromDouble(d);
+    }
+    case NATIVE_FLOAT: {
+        float f;
+        if((s->e - s->p) < (Py_ssize_t) sizeof f) {
+            truncated();
+            return NULL;
+        }
+        memcpy(&f, s->p, sizeof f);
+        s->p += sizeof f;
+        return PyFloat_FromDouble(f);
+    }
+    case NATIVE_I32:
+        if(read_le(s, 4, &u)) {
+            return NULL;
+        }
+        return from_i64((int32_t) (uint32_t) u);
+    case NATIVE_I64:
+        if(read_le(s, 8, &u)) {
+            return NULL;
+        }
+        return from_i64((int64_t) u);
+    case NATIVE_U32:
+        if(read_le(s, 4, &u)) {
+            return NULL;
+        }
+        return from_u64(u);
+    case NATIVE_U64:
+        if(read_le(s, 8, &u)) {
+            return NULL;
+        }
+        return from_u64(u);
+    case NATIVE_BLOB:
+        if(read_delimited(s, &p, &len)) {
+            return NULL;
+        }
+        return PyString_FromStringAndSize((char *) p, len);
+    case NATIVE_TEXT:
+        if(read_delimited(s, &p, &len)) {
+            return NULL;
+        }
+        return PyUnicode_DecodeUTF8((char *) p, len, "strict");
+    }
+    PyErr_Format(PyExc_ValueError, "bad native kind %d", native);
+    return NULL;
+}
+
+/**
+ * Decode the value of `field` at `s` using `native`, or if zero, by calling
+ * field.coder.read_value(field, buf, pos). Return a new reference, or set an
+ * exception and return NULL.
+ */
+static PyObject *
+read_value(Slice *s, PyObject *buf, Slice *start, int native, PyObject *field)
+{
+    if(native) {
+        return read_native(s, native);
+    }
+
+    PyObject *coder = PyObject_GetAttrString(field, "coder");
+    if(! coder) {
+        return NULL;
+    }
+    PyObject *res = PyObject_CallMethod(coder, "read_value", "OOn", field, buf,
+                                        (Py_ssize_t) (s->p - start->p));
+    Py_DECREF(coder);
+    if(! res) {
+        return NULL;
+    }
+
+    Py_ssize_t pos;
+    PyObject *value;
+    if(! PyArg_ParseTuple(res, "nO", &pos, &value)) {
+        Py_DECREF(res);
+        return NULL;
+    }
+    if(pos < 0 || pos > (start->e - start->p)) {
+        Py_DECREF(res);
+        truncated();
+        return NULL;
+    }
+    s->p = start->p + pos;
+    Py_INCREF(value);
+    Py_DECREF(res);
+    return value;
+}
+
+
+/**
+ * Append the varint encoding of `v` to `wtr`. Return 0 on success, or set an
+ * exception and return -1.
+ */
+static int
+write_varint(struct writer *wtr, uint64_t v)
+{
+    uint8_t buf[VARINT_MAX];
+    int i = 0;
+    while(v >= 0x80) {
+        buf[i++] = 0x80 | (uint8_t) v;
+        v >>= 7;
+    }
+    buf[i++] = (uint8_t) v;
+    return acid_writer_puts(wtr, (char *) buf, i);
+}
+
+/**
+ * Append `v` to `wtr` as `n` little endian bytes.
+ */
+static int
+write_le(struct writer *wtr, uint64_t v, int n)
+{
+    uint8_t buf[8];
+    for(int i = 0; i < n; i++) {
+        buf[i] = (uint8_t) (v >> (8 * i));
+    }
+    return acid_writer_puts(wtr, (char *) buf, n);
+}
+
+/**
+ * Append the delimited string `p` of `len` bytes to `wtr`.
+ */
+static int
+write_delimited(struct writer *wtr, const char *p, Py_ssize_t len)
+{
+    if(write_varint(wtr, (uint64_t) len)) {
+        return -1;
+    }
+    return acid_writer_puts(wtr, p, len);
+}
+
+/**
+ * Return 1 if `value` has the exact type written natively for `native`,
+ * otherwise 0, so the field's coder handles conversions and errors.
+ */
+static int
+is_native_type(int native, PyObject *value)
+{
+    switch(native) {
+    case NATIVE_BOOL:
+        return PyBool_Check(value);
+    case NATIVE_DOUBLE:
+    case NATIVE_FLOAT:
+        return PyFloat_CheckExact(value);
+    case NATIVE_BLOB:
+        return PyString_CheckExact(value);
+    case NATIVE_TEXT:
+        return PyUnicode_CheckExact(value);
+    case NATIVE_NONE:
+        return 0;
+    }
+    return PyInt_CheckExact(value) || PyLong_CheckExact(value);
+}
+
+/**
+ * Append the encoding of `value`, having the kind `native`, to `wtr`. Return
+ * 0 on success, or set an exception and return -1.
+ */
+static int
+write_native(struct writer *wtr, int native, PyObject *value)
+{
+    uint64_t u;
+    switch(native) {
+    case NATIVE_VARINT:
+    case NATIVE_UVARINT:
+        if(to_u64(value, &u)) {
+            return -1;
+        }
+        return write_varint(wtr, u);
+    case NATIVE_SVARINT: {
+        if(to_u64(value, &u)) {
+            return -1;
+        }
+        int64_t v = (int64_t) u;
+        return write_varint(wtr, (((uint64_t) v) << 1) ^ (uint64_t) (v >> 63));
+    }
+    case NATIVE_BOOL: {
+        char ch = (value == Py_True);
+        return acid_writer_puts(wtr, &ch, 1);
+    }
+    case NATIVE_DOUBLE: {
+        double d = PyFloat_AS_DOUBLE(value);
+        return acid_writer_puts(wtr, (char *) &d, sizeof d);
+    }
+    case NATIVE_FLOAT: {
+        double d = PyFloat_AS_DOUBLE(value);
+        float f = (float) d;
+        // Like struct.pack('<f'), reject finite values that round to inf.
+        if(Py_IS_INFINITY(f) && ! Py_IS_INFINITY(d)) {
+            PyErr_SetString(PyExc_OverflowError,
+                            "float too large to pack with f format");
+            return -1;
+        }
+        return acid_writer_puts(wtr, (char *) &f, sizeof f);
+    }
+    case NATIVE_I32:
+    case NATIVE_U32: {
+        PY_LONG_LONG v = PyLong_AsLongLong(value);
+        if(v == -1 && PyErr_Occurred()) {
+            return -1;
+        }
+        if((native == NATIVE_I32) ? (v < INT32_MIN || v > INT32_MAX)
+                                  : (v < 0 || v > UINT32_MAX)) {
+            PyErr_SetString(PyExc_OverflowError, "value out of range.");
+            return -1;
+        }
+        return write_le(wtr, (uint64_t) v, 4);
+    }
+    case NATIVE_I64:
+        if(! (PyLong_Check(value) && _PyLong_Sign(value) >= 0)) {
+            PY_LONG_LONG v = PyLong_AsLongLong(value);
+            if(v == -1 && PyErr_Occurred()) {
+                return -1;
+            }
+            return write_le(wtr, (uint64_t) v, 8);
+        }
+        /* fall through */
+    case NATIVE_U64: {
+        unsigned PY_LONG_LONG v;
+        if(PyInt_Check(value)) {
+            long l = PyInt_AS_LONG(value);
+            if(l < 0) {
+                PyErr_SetString(PyExc_OverflowError, "value out of range.");
+                return -1;
+            }
+            v = (unsigned PY_LONG_LONG) l;
+        } else {
+            v = PyLong_AsUnsignedLongLong(value);
+            if(v == (unsigned PY_LONG_LONG) -1 && PyErr_Occurred()) {
+                return -1;
+            }
+        }
+        if(native == NATIVE_I64 && v > INT64_MAX) {
+            PyErr_SetString(PyExc_OverflowError, "value out of range.");
+            return -1;
+        }
+        return write_le(wtr, (uint64_t) v, 8);
+    }
+    case NATIVE_BLOB:
+        return write_delimited(wtr, PyString_AS_STRING(value),
+                               PyString_GET_SIZE(value));
+    case NATIVE_TEXT: {
+        PyObject *utf8 = PyUnicode_AsUTF8String(value);
+        if(! utf8) {
+            return -1;
+        }
+        int rc = write_delimited(wtr, PyString_AS_STRING(utf8),
+                                 PyString_GET_SIZE(utf8));
+        Py_DECREF(utf8);
+        return rc;
+    }
+    }
+    PyErr_Format(PyExc_ValueError, "bad native kind %d", native);
+    return -1;
+}
+
+/**
+ * Append the encoding of `value` to `wtr` by calling
+ * field.coder.write_value(field, value, parts.append), then appending each
+ * string written. Return 0 on success, or set an exception and return -1.
+ */
+static int
+write_coder(struct writer *wtr, PyObject *field, PyObject *value)
+{
+    int rc = -1;
+    PyObject *parts = PyList_New(0);
+    PyObject *append = parts ? PyObject_GetAttrString(parts, "append") : NULL;
+    PyObject *coder = PyObject_GetAttrString(field, "coder");
+    PyObject *res = NULL;
+    if(append && coder) {
+        res = PyObject_CallMethod(coder, "write_value", "OOO", field, value,
+                                  append);
+    }
+    if(res) {
+        rc = 0;
+        for(Py_ssize_t i = 0; rc == 0 && i < PyList_GET_SIZE(parts); i++) {
+            Slice part;
+            rc = acid_make_reader(&part, PyList_GET_ITEM(parts, i));
+            if(! rc) {
+                rc = acid_writer_puts(wtr, (char *) part.p, part.e - part.p);
+            }
+        }
+    }
+    Py_XDECREF(res);
+    Py_XDECREF(coder);
+    Py_XDECREF(append);
+    Py_XDECREF(parts);
+    return rc;
+}
+
+
+/**
+ * structlib.read_varint(buf, pos) -> (pos, value).
+ */
+static PyObject *
+py_read_varint(PyObject *self, PyObject *args)
+{
+    PyObject *buf;
+    Py_ssize_t pos;
+    if(! PyArg_ParseTuple(args, "On", &buf, &pos)) {
+        return NULL;
+    }
+
+    Slice start;
+    if(make_reader(&start, buf)) {
+        return NULL;
+    }
+    if(pos < 0 || pos > (start.e - start.p)) {
+        return PyErr_Format(PyExc_IndexError, "position out of range");
+    }
+
+    Slice s = {start.p + pos, start.e};
+    uint64_t u;
+    if(read_varint(&s, &u)) {
+        return NULL;
+    }
+    PyObject *value = from_i64((int64_t) u);
+    if(! value) {
+        return NULL;
+    }
+    return Py_BuildValue("nN", (Py_ssize_t) (s.p - start.p), value);
+}
+
+/**
+ * structlib.write_varint(w, i).
+ */
+static PyObject *
+py_write_varint(PyObject *self, PyObject *args)
+{
+    PyObject *w;
+    PyObject *i;
+    if(! PyArg_ParseTuple(args, "OO", &w, &i)) {
+        return NULL;
+    }
+
+    uint64_t u;
+    if(to_u64(i, &u)) {
+        return NULL;
+    }
+
+    struct writer wtr;
+    if(acid_writer_init(&wtr, VARINT_MAX)) {
+        return NULL;
+    }
+    if(write_varint(&wtr, u)) {
+        acid_writer_abort(&wtr);
+        return NULL;
+    }
+    PyObject *s = PyString_FromStringAndSize(PyString_AS_STRING(wtr.s),
+                                             wtr.pos);
+    acid_writer_abort(&wtr);
+    if(! s) {
+        return NULL;
+    }
+    PyObject *res = PyObject_CallFunctionObjArgs(w, s, NULL);
+    Py_DECREF(s);
+    return res;
+}
+
+/**
+ * structlib.decode_fields(buf, fields) -> [(name, value), ...].
+ */
+static PyObject *
+py_decode_fields(PyObject *self, PyObject *args)
+{
+    PyObject *buf;
+    PyObject *fields;
+    if(! PyArg_ParseTuple(args, "OO!", &buf, &PyDict_Type, &fields)) {
+        return NULL;
+    }
+
+    Slice start;
+    if(make_reader(&start, buf)) {
+        return NULL;
+    }
+
+    PyObject *out = PyList_New(0);
+    if(! out) {
+        return NULL;
+    }
+
+    Slice s = start;
+    while(s.p < s.e) {
+        uint64_t wire_key;
+        if(read_varint(&s, &wire_key)) {
+            goto error;
+        }
+        PyObject *key = from_u64(wire_key);
+        if(! key) {
+            goto error;
+        }
+        PyObject *entry = PyDict_GetItem(fields, key);
+        Py_DECREF(key);
+        if(! entry) {
+            if(skip_value(&s, (int) (wire_key & 0x7))) {
+                goto error;
+            }
+            continue;
+        }
+
+        PyObject *name;
+        int native;
+        PyObject *field;
+        if(! PyArg_ParseTuple(entry, "OiO", &name, &native, &field)) {
+            goto error;
+        }
+        PyObject *value = read_value(&s, buf, &start, native, field);
+        if(! value) {
+            goto error;
+        }
+        PyObject *pair = PyTuple_Pack(2, name, value);
+        Py_DECREF(value);
+        if(! pair) {
+            goto error;
+        }
+        int rc = PyList_Append(out, pair);
+        Py_DECREF(pair);
+        if(rc) {
+            goto error;
+        }
+    }
+    return out;
+
+error:
+    Py_DECREF(out);
+    return NULL;
+}
+
+/**
+ * structlib.read_field(buf, wire_key, native, field) -> value or None.
+ */
+static PyObject *
+py_read_field(PyObject *self, PyObject *args)
+{
+    PyObject *buf;
+    unsigned PY_LONG_LONG target;
+    int native;
+    PyObject *field;
+    if(! PyArg_ParseTuple(args, "OKiO", &buf, &target, &native, &field)) {
+        return NULL;
+    }
+
+    Slice start;
+    if(make_reader(&start, buf)) {
+        return NULL;
+    }
+
+    Slice s = start;
+    while(s.p < s.e) {
+        uint64_t wire_key;
+        if(read_varint(&s, &wire_key)) {
+            return NULL;
+        }
+        if(wire_key == target) {
+            return read_value(&s, buf, &start, native, field);
+        }
+        if(skip_value(&s, (int) (wire_key & 0x7))) {
+            return NULL;
+        }
+    }
+    Py_RETURN_NONE;
+}
+
+/**
+ * Resume scanning `start` from the offset stored under `resume_key` in
+ * `offsets`, recording the offset of the first value of each field passed,
+ * until the value with wire key `key` is skipped. Store its offset in
+ * `*found`, or -1 if it is absent. Return 0 on success, or set an exception
+ * and return -1.
+ */
+static int
+scan_offsets(PyObject *offsets, Slice *start, PyObject *key,
+             Py_ssize_t *found)
+{
+    uint64_t target;
+    if(to_u64(key, &target)) {
+        return -1;
+    }
+
+    Slice s = *start;
+    PyObject *resume = PyDict_GetItem(offsets, resume_key);
+    if(resume) {
+        Py_ssize_t off = PyInt_AsSsize_t(resume);
+        if(off == -1 && PyErr_Occurred()) {
+            return -1;
+        }
+        if(off < 0 || off > (s.e - s.p)) {
+            return truncated();
+        }
+        s.p += off;
+    }
+
+    *found = -1;
+    while(*found == -1 && s.p < s.e) {
+        uint64_t wire_key;
+        if(read_varint(&s, &wire_key)) {
+            return -1;
+        }
+        Py_ssize_t off = s.p - start->p;
+        PyObject *k = from_u64(wire_key);
+        if(! k) {
+            return -1;
+        }
+        int rc = 0;
+        if(! PyDict_GetItem(offsets, k)) {
+            PyObject *pos = PyInt_FromSsize_t(off);
+            rc = pos ? PyDict_SetItem(offsets, k, pos) : -1;
+            Py_XDECREF(pos);
+        }
+        Py_DECREF(k);
+        if(rc || skip_value(&s, (int) (wire_key & 0x7))) {
+            return -1;
+        }
+        if(wire_key == target) {
+            *found = off;
+        }
+    }
+
+    PyObject *pos = PyInt_FromSsize_t(s.p - start->p);
+    int rc = pos ? PyDict_SetItem(offsets, resume_key, pos) : -1;
+    Py_XDECREF(pos);
+    return rc;
+}
+
+/**
+ * structlib.read_cached(struct, wire_key, native, field) -> value or None.
+ */
+static PyObject *
+py_read_cached(PyObject *self, PyObject *args)
+{
+    PyObject *struct_;
+    PyObject *key;
+    int native;
+    PyObject *field;
+    if(! PyArg_ParseTuple(args, "OOiO", &struct_, &key, &native, &field)) {
+        return NULL;
+    }
+
+    PyObject *buf = PyObject_GetAttr(struct_, buf_str);
+    if(! buf) {
+        return NULL;
+    }
+    PyObject *ret = NULL;
+    PyObject *offsets = PyObject_GetAttr(struct_, offsets_str);
+    if(offsets == Py_None) {
+        Py_DECREF(offsets);
+        offsets = PyDict_New();
+        if(offsets && PyObject_SetAttr(struct_, offsets_str, offsets)) {
+            Py_CLEAR(offsets);
+        }
+    }
+    if(! offsets) {
+        goto out;
+    }
+    if(! PyDict_Check(offsets)) {
+        PyErr_SetString(PyExc_TypeError, "_offsets must be a dict.");
+        goto out;
+    }
+
+    Slice start;
+    if(make_reader(&start, buf)) {
+        goto out;
+    }
+
+    Py_ssize_t off;
+    PyObject *pos = PyDict_GetItem(offsets, key);
+    if(pos) {
+        off = PyInt_AsSsize_t(pos);
+        if(off == -1 && PyErr_Occurred()) {
+            goto out;
+        }
+    } else if(scan_offsets(offsets, &start, key, &off)) {
+        goto out;
+    } else if(off == -1) {
+        Py_INCREF(Py_None);
+        ret = Py_None;
+        goto out;
+    }
+    if(off < 0 || off > (start.e - start.p)) {
+        truncated();
+        goto out;
+    }
+    Slice s = {start.p + off, start.e};
+    ret = read_value(&s, buf, &start, native, field);
+
+out:
+    Py_XDECREF(offsets);
+    Py_DECREF(buf);
+    return ret;
+}
+
+/**
+ * structlib.project_fields(buf, fields, n) -> (value, ...).
+ */
+static PyObject *
+py_project_fields(PyObject *self, PyObject *args)
+{
+    PyObject *buf;
+    PyObject *fields;
+    Py_ssize_t n;
+    if(! PyArg_ParseTuple(args, "OO!n", &buf, &PyDict_Type, &fields, &n)) {
+        return NULL;
+    }
+
+    Slice start;
+    if(make_reader(&start, buf)) {
+        return NULL;
+    }
+
+    PyObject *out = PyTuple_New(n);
+    if(! out) {
+        return NULL;
+    }
+
+    Py_ssize_t remain = PyDict_Size(fields);
+    Slice s = start;
+    while(remain && s.p < s.e) {
+        uint64_t wire_key;
+        if(read_varint(&s, &wire_key)) {
+            goto error;
+        }
+        PyObject *key = from_u64(wire_key);
+        if(! key) {
+            goto error;
+        }
+        PyObject *entry = PyDict_GetItem(fields, key);
+        Py_DECREF(key);
+
+        Py_ssize_t idx = -1;
+        int native = 0;
+        PyObject *field = NULL;
+        if(entry) {
+            if(! PyArg_ParseTuple(entry, "niO", &idx, &native, &field)) {
+                goto error;
+            }
+            if(idx < 0 || idx >= n) {
+                PyErr_SetString(PyExc_IndexError, "field index out of range");
+                goto error;
+            }
+        }
+        if(idx == -1 || PyTuple_GET_ITEM(out, idx)) {
+            if(skip_value(&s, (int) (wire_key & 0x7))) {
+                goto error;
+            }
+            continue;
+        }
+
+        PyObject *value = read_value(&s, buf, &start, native, field);
+        if(! value) {
+            goto error;
+        }
+        PyTuple_SET_ITEM(out, idx, value);
+        remain--;
+    }
+
+    for(Py_ssize_t i = 0; i < n; i++) {
+        if(! PyTuple_GET_ITEM(out, i)) {
+            Py_INCREF(Py_None);
+            PyTuple_SET_ITEM(out, i, Py_None);
+        }
+    }
+    return out;
+
+error:
+    Py_DECREF(out);
+    return NULL;
+}
+
+/**
+ * structlib.encode_fields(dct, fields) -> str.
+ */
+static PyObject *
+py_encode_fields(PyObject *self, PyObject *args)
+{
+    PyObject *dct;
+    PyObject *fields;
+    if(! PyArg_ParseTuple(args, "O!O!", &PyDict_Type, &dct,
+                          &PyList_Type, &fields)) {
+        return NULL;
+    }
+
+    struct writer wtr;
+    if(acid_writer_init(&wtr, 64)) {
+        return NULL;
+    }
+
+    for(Py_ssize_t i = 0; i < PyList_GET_SIZE(fields); i++) {
+        PyObject *name;
+        PyObject *wire_key_s;
+        int native;
+        PyObject *field;
+        if(! PyArg_ParseTuple(PyList_GET_ITEM(fields, i), "OSiO",
+                              &name, &wire_key_s, &native, &field)) {
+            goto error;
+        }
+        PyObject *value = PyDict_GetItem(dct, name);
+        if(! value || value == Py_None) {
+            continue;
+        }
+        if(is_native_type(native, value)) {
+            if(acid_writer_puts(&wtr, PyString_AS_STRING(wire_key_s),
+                                PyString_GET_SIZE(wire_key_s))) {
+                goto error;
+            }
+            if(write_native(&wtr, native, value)) {
+                goto error;
+            }
+        } else if(write_coder(&wtr, field, value)) {
+            goto error;
+        }
+    }
+
+    PyObject *out = PyString_FromStringAndSize(PyString_AS_STRING(wtr.s),
+                                               wtr.pos);
+    acid_writer_abort(&wtr);
+    return out;
+
+error:
+    acid_writer_abort(&wtr);
+    return NULL;
+}
+
+
+/**
+ * Table of functions exported in the acid._structlib module.
+ */
+static PyMethodDef StructlibMethods[] = {
+    {"read_varint", py_read_varint, METH_VARARGS, "read_varint"},
+    {"write_varint", py_write_varint, METH_VARARGS, "write_varint"},
+    {"decode_fields", py_decode_fields, METH_VARARGS, "decode_fields"},
+    {"read_field", py_read_field, METH_VARARGS, "read_field"},
+    {"encode_fields", py_encode_fields, METH_VARARGS, "encode_fields"},
+    {"read_cached", py_read_cached, METH_VARARGS, "read_cached"},
+    {"project_fields", py_project_fields, METH_VARARGS, "project_fields"},
+    {NULL, NULL, 0, NULL}
+};
+
+
+/**
+ * Do all required to initialize acid._structlib.
+ */
+int
+acid_init_structlib_module(void)
+{
+    buf_str = PyString_InternFromString("_buf");
+    offsets_str = PyString_InternFromString("_offsets");
+    resume_key = PyInt_FromLong(-1);
+    if(! (buf_str && offsets_str && resume_key)) {
+        return -1;
+    }
+    PyObject *mod = acid_init_module("_structlib", StructlibMethods);
+    return mod ? 0 : -1;
+}
@@ -47,7 +47,8 @@ if use_cpython:
     ext_modules = [
         Extension("_acid", sources=[
             'ext/acid.c', 'ext/keylib.c', 'ext/key.c', 'ext/keylist.c',
-            'ext/core.c', 'ext/fixed_offset.c', 'ext/iterators.c'
+            'ext/core.c', 'ext/fixed_offset.c', 'ext/iterators.c',
+            'ext/batch.c', 'ext/compress.c', 'ext/structlib.c'
         ], extra_compile_args=extra_compile_args)
     ]
 
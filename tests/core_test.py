@@ -18,13 +18,21 @@
 core.py tests.
 """
 
+import itertools
+import threading
+import time
+import warnings
+import zlib
+
 import acid
 import acid.core
 import acid.engines
+import acid.structlib
 from acid import keylib
 
 import testlib
 from testlib import eq
+from testlib import lt
 
 
 #@testlib.register()
@@ -108,6 +116,45 @@ class IterTest:
         eq(self.REVERSE, self.riter())
 
 
+@testlib.register()
+class DispatcherTest:
+    def test_empty(self):
+        acid.core.Dispatcher()(1, 2)
+
+    def test_order(self):
+        calls = []
+        d = acid.core.Dispatcher()
+        d.append(lambda *args: calls.append(('a', args)))
+        d.append(lambda *args: calls.append(('b', args)))
+        d(1, 2)
+        eq([('b', (1, 2)), ('a', (1, 2))], calls)
+
+    def test_remove(self):
+        calls = []
+        ok = lambda *args: calls.append(args)
+        d = acid.core.Dispatcher([ok, lambda: 1 / 0, lambda: False, ok])
+        d()
+        eq([ok, ok], list(d))
+        eq(2, len(calls))
+
+    def test_base_exception(self):
+        def interrupt():
+            raise KeyboardInterrupt
+        d = acid.core.Dispatcher([interrupt])
+        self.assertRaises(KeyboardInterrupt, d)
+        self.assertRaises(KeyboardInterrupt, acid.core.dispatch, d)
+        eq([interrupt], list(d))
+
+    def test_mutate(self):
+        calls = []
+        d = acid.core.Dispatcher()
+        d.append(lambda: calls.append(1))
+        d.append(lambda: d.pop())
+        d()
+        eq([1], calls)
+        eq(1, len(d))
+
+
 @testlib.register()
 class OneCollBoundsTest:
     def setUp(self):
@@ -287,6 +334,287 @@ class IndexTest:
         assert not self.i.has((69, u'dave123'))
         assert self.i.has((69, u'dave2'))
 
+    def testItemsJoin(self):
+        coll = self.store.add_collection('many')
+        idx = acid.add_index(coll, 'neg', lambda obj: -obj)
+        coll.put_many(range(200))
+        coll.strategy.batch(max_recs=20)
+        seeks = []
+        iter_ = coll.strategy.iter
+        coll.strategy.iter = lambda txn: (seeks.append(1), iter_(txn))[1]
+        expect = [((200 - i,), 199 - i) for i in xrange(200)]
+        eq(expect, list(idx.items()))
+        eq(expect[::-1], list(idx.items(reverse=True)))
+        # One seek per chunk of index entries.
+        eq(8, len(seeks))
+
+    def testItemsStale(self):
+        prefix = self.coll.strategy.prefix
+        self.store.engine.delete(keylib.packs(self.key, prefix))
+        with warnings.catch_warnings(record=True) as caught:
+            warnings.simplefilter('always')
+            eq([(self.key2, u'dave2')], list(self.i.items()))
+        eq(1, len(caught))
+
+    def testCovered(self):
+        idx = acid.add_index(self.coll, 'cov', lambda obj: obj[:3],
+                             cover=lambda obj: (len(obj), obj.upper()))
+        assert idx.build()
+        key3 = self.coll.put(u'daisy')
+        self.coll.get_many = None
+        eq([(key3, (5, u'DAISY'))], list(idx.items(u'dai', covered=True)))
+        eq([(5, u'DAISY'), (4, u'DAVE'), (5, u'DAVE2')],
+           list(idx.values(covered=True)))
+        self.assertRaises(ValueError, self.i.items, covered=True)
+
+        # Entry rewritten when only the included value changes.
+        self.coll.put(u'daisies', key=key3)
+        eq([(7, u'DAISIES')], list(idx.values(u'dai', covered=True)))
+
+    def testCoveredOldEntries(self):
+        # Entries written before `cover` was given fall back to the record.
+        idx = acid.add_index(self.coll, 'idx', lambda obj: (69, obj),
+                             cover=len)
+        eq([(self.key, (4,)), (self.key2, (5,))],
+           list(idx.items(covered=True)))
+
+    def testBuild(self):
+        coll = self.store.add_collection('many')
+        coll.put_many(range(250))
+        idx = acid.add_index(coll, 'neg', lambda obj: -obj)
+        assert not idx.ready
+        self.assertRaises(acid.errors.ConfigError, idx.keys)
+
+        eq(False, idx.build(max_recs=100))
+        # Records written during the build are indexed.
+        coll.delete(10)
+        coll.put(1000, key=100)
+        coll.put(2000, key=300)
+        eq(False, idx.build(max_recs=100))
+        eq(True, idx.build(max_recs=100))
+        assert idx.ready
+
+        expect = sorted(coll.items(), key=lambda (key, obj): -obj)
+        eq(expect, list(idx.items()))
+
+        # Reopening sees the completed build.
+        idx2 = acid.add_index(acid.Collection(self.store, coll.info),
+                              'neg', lambda obj: -obj)
+        assert idx2.ready
+
+    def testEstimate(self):
+        coll = self.store.add_collection('skew')
+        idx = acid.add_index(coll, 'idx', lambda obj: (obj % 2, obj % 10))
+        eq(None, idx.estimate(0))
+        # Record 0 dominates: 900 entries vs. 100 spread over 9 values.
+        coll.put_many([0] * 900 + range(1, 101))
+        stats = idx.analyze(buckets=8)
+        eq(1000, stats['count'])
+        eq([2, 10], stats['distinct'])
+        assert 8 <= len(stats['bounds']) <= 18
+        eq(stats, idx.stats())
+
+        for args in ((0, 0), (1, 3), (0, 4)):
+            actual = idx.count(args)
+            est = idx.estimate(args)
+            assert (actual / 2) <= est <= (actual * 2), (args, actual, est)
+        for prefix in (0, 1):
+            actual = idx.count(prefix=prefix)
+            est = idx.estimate(prefix=prefix)
+            assert (actual / 2) <= est <= (actual * 2), (prefix, actual, est)
+        eq(0, idx.estimate(prefix=2))
+        eq(0, idx.estimate(lo=(1, 9), hi=(1, 8)))
+        eq(1000, idx.estimate())
+        # Falsy bounds are not ignored.
+        eq(0, idx.estimate(hi=0))
+        eq(0, idx.estimate(lo=0, hi=0))
+        actual = idx.count(lo=0, hi=1)
+        est = idx.estimate(lo=0, hi=1)
+        assert (actual / 2) <= est <= (actual * 2), (actual, est)
+
+    def testRebuild(self):
+        junk = keylib.packs([(1,), (1234,)], self.i.prefix)
+        self.store.engine.put(junk, '')
+        self.i.rebuild()
+        self.assertRaises(acid.errors.ConfigError, self.i.keys)
+        steps = 0
+        while not self.i.build(max_recs=1):
+            steps += 1
+        # 3 entries deleted and 2 records indexed, with each phase ending
+        # when a step finds nothing left.
+        eq(6, steps)
+        eq(self.both, list(self.i.pairs()))
+
+    def testReplaceDiff(self):
+        e = testlib.CountingEngine(acid.engines.ListEngine())
+        store = acid.Store(e)
+        with store.begin(write=True):
+            coll = store.add_collection('tagged')
+            idx = acid.add_index(coll, 'tags', lambda obj: obj[u'tags'])
+            tags = [u'tag%d' % i for i in xrange(30)]
+            key = coll.put({u'tags': tags})
+            puts = e.put_count
+            deletes = e.delete_count
+            coll.put({u'tags': tags[1:] + [u'new']}, key=key)
+            # The record, plus one index entry.
+            eq(puts + 2, e.put_count)
+            eq(deletes + 1, e.delete_count)
+            eq(sorted(tags[1:] + [u'new']), [t[0] for t in idx.tups()])
+
+    def testUnique(self):
+        coll = self.store.add_collection('people')
+        idx = acid.add_index(coll, 'name', lambda obj: obj[u'name'],
+                             unique=True)
+        k1 = coll.put({u'name': u'alice'})
+        k2 = coll.put({u'name': u'bob'})
+        self.assertRaises(acid.errors.UniqueError, coll.put,
+                          {u'name': u'alice'})
+        # Rewriting a record with its own tuple is allowed.
+        coll.put({u'name': u'alice', u'age': 1}, key=k1)
+        self.assertRaises(acid.errors.ConstraintError, coll.put,
+                          {u'name': u'bob'}, key=k1)
+        coll.delete(k2)
+        coll.put({u'name': u'bob'}, key=k1)
+        eq([(k1, {u'name': u'bob'})], list(idx.items()))
+        # Duplicates within a batch are detected before anything is written.
+        self.assertRaises(acid.errors.UniqueError, coll.put_many,
+                          [{u'name': u'carol'}, {u'name': u'carol'}])
+        eq(1, len(list(coll.keys())))
+
+    def testUniqueBuild(self):
+        coll = self.store.add_collection('dups')
+        coll.put_many([1, 2, 1])
+        idx = acid.add_index(coll, 'val', lambda obj: obj, unique=True)
+        # Records not yet indexed are checked too.
+        self.assertRaises(acid.errors.UniqueError, coll.put, 2)
+        self.assertRaises(acid.errors.UniqueError, idx.build)
+        # Removing the duplicate allows the build to complete.
+        coll.delete(3)
+        assert idx.build()
+        eq([[(1,), (1,)], [(2,), (2,)]], list(idx.pairs()))
+        self.assertRaises(acid.errors.UniqueError, coll.put, 2)
+
+    def testPartial(self):
+        coll = self.store.add_collection('tickets')
+        calls = []
+        def func(obj):
+            calls.append(obj)
+            return obj[u'owner']
+        idx = acid.add_index(coll, 'open', func, where={u'status': u'open'})
+        k1 = coll.put({u'owner': u'al', u'status': u'open'})
+        coll.put({u'owner': u'bo', u'status': u'closed'})
+        coll.put({u'owner': u'cy'})
+        eq(1, len(calls))
+        eq([[(u'al',), k1]], list(idx.pairs()))
+        coll.put({u'owner': u'al', u'status': u'closed'}, key=k1)
+        eq([], list(idx.pairs()))
+        # Only to find the old entry.
+        eq(2, len(calls))
+        # The planner may use the index, since conditions imply `where`.
+        eq([], list(coll.query(open=u'bo')))
+
+    def testPartialRaw(self):
+        st = acid.structlib.StructType()
+        st.add_field('owner', 1, 'text', False)
+        st.add_field('status', 2, 'varint', False)
+        coll = self.store.add_collection('structs',
+            encoder=acid.encoders.make_struct_encoder(st))
+        for i in xrange(10):
+            rec = st.new()
+            rec.owner = u'user%d' % i
+            rec.status = i % 3
+            coll.put(rec)
+        idx = acid.add_index(coll, 'busy', lambda rec: rec.owner,
+                             where={'status': acid.Range(1)})
+        assert idx.build()
+        eq([u'user%d' % i for i in xrange(10) if i % 3],
+           [t[0] for t in idx.tups()])
+        self.assertRaises(acid.errors.ConfigError, acid.add_index, coll,
+                          'bad', lambda rec: rec.owner, where={'x': 1})
+
+        keyed = self.store.add_collection('keyed', encoder=acid.encoders.KEY)
+        keyed.put_many([(u'a', 1), (u'b', 2), (u'c', 1)])
+        idx = acid.add_index(keyed, 'first', lambda tup: tup[0],
+                             where={1: 1})
+        assert idx.build()
+        eq([(u'a',), (u'c',)], list(idx.tups()))
+
+    def testGetMany(self):
+        eq([u'dave2', None, u'dave'],
+           self.coll.get_many([self.key2, 123, self.key]))
+        eq([None], self.coll.get_many([123], None, True))
+
+
+@testlib.register()
+class QueryTest:
+    def setUp(self):
+        self.store = acid.open('list:/')
+        self.t = self.store.begin(write=True)
+        self.t.__enter__()
+        self.coll = self.store.add_collection('recs')
+        self.a = acid.add_index(self.coll, 'a', lambda obj: obj[u'a'])
+        self.b = acid.add_index(self.coll, 'b', lambda obj: obj[u'b'])
+        self.tags = acid.add_index(self.coll, 'tags', lambda obj: obj[u'tags'])
+        self.coll.put_many({u'a': i % 10, u'b': (i // 10) % 10,
+                            u'tags': [u'x', u'y'][:i % 3]}
+                           for i in xrange(1000))
+        for idx in self.a, self.b, self.tags:
+            idx.analyze()
+
+    def tearDown(self):
+        self.t.__exit__(None, None, None)
+
+    def expect(self, pred):
+        return [(k, v) for k, v in self.coll.items() if pred(v)]
+
+    def testPlans(self):
+        eq('index', self.coll.plan(a=3).kind)
+        eq(['a'], self.coll.plan(a=3).indices)
+        eq('intersect', self.coll.plan(a=3, b=4).kind)
+        eq('scan', self.coll.plan(a=acid.Range(1)).kind)
+        eq('key', self.coll.plan(key=5, a=3).kind)
+
+    def testIntersectMax(self):
+        # Intersection is not planned when too many keys would be held.
+        old = acid.core.Plan.INTERSECT_MAX
+        acid.core.Plan.INTERSECT_MAX = 50
+        try:
+            eq('index', self.coll.plan(a=3, b=4).kind)
+            eq(self.expect(lambda v: v[u'a'] == 3 and v[u'b'] == 4),
+               list(self.coll.query(a=3, b=4)))
+        finally:
+            acid.core.Plan.INTERSECT_MAX = old
+
+    def testResults(self):
+        eq(self.expect(lambda v: v[u'a'] == 3 and v[u'b'] == 4),
+           list(self.coll.query(a=3, b=4)))
+        eq(self.expect(lambda v: v[u'a'] >= 8 and v[u'b'] < 2),
+           list(self.coll.query(a=acid.Range(8), b=acid.Range(hi=2))))
+        eq(self.expect(lambda v: v[u'a'] == 9 and v[u'b'] == 9),
+           list(self.coll.query(a=acid.Range(9, 9, include=True),
+                                b=acid.Prefix(9))))
+        eq([(acid.Key(5), {u'a': 4, u'b': 0, u'tags': [u'x']})],
+           list(self.coll.query(key=5, a=4)))
+        eq([], list(self.coll.query(key=5, a=3)))
+
+    def testMultiValued(self):
+        # Records with both tags are yielded once.
+        got = list(self.coll.query(tags=u'x'))
+        eq(self.expect(lambda v: u'x' in v[u'tags']), sorted(got))
+
+    def testWhereMax(self):
+        got = self.coll.query(a=1, where=lambda v: v[u'b'] > 5, max=3)
+        eq(self.expect(lambda v: v[u'a'] == 1 and v[u'b'] > 5)[:3],
+           list(got))
+
+    def testUnbuilt(self):
+        c = acid.add_index(self.coll, 'c', lambda obj: obj[u'a'] * 2)
+        eq('index', self.coll.plan(a=3, c=6).kind)
+        eq(self.expect(lambda v: v[u'a'] == 3), list(self.coll.query(c=6)))
+
+    def testUnknown(self):
+        self.assertRaises(ValueError, self.coll.query, d=1)
+
 
 class Bag(object):
     def __init__(self, **kwargs):
@@ -328,27 +656,44 @@ class BatchTest:
         for key, val in self.ITEMS:
             assert self.coll.get(key) == val
 
+    def test_batch_result(self):
+        self.insert_items()
+        found, made, last_key = self.coll.strategy.batch(max_recs=2)
+        eq((3, 2, (4,)), (found, made, last_key))
+        eq(self.old_len + 2, len(self.e.items))
+        eq(self.ITEMS, list(self.coll.items()))
+
+    def test_batch_max_bytes(self):
+        self.insert_items()
+        # Header is 10 bytes, each member 1 + suffix + value bytes.
+        self.coll.strategy.batch(max_bytes=25)
+        eq(self.old_len + 2, len(self.e.items))
+        eq(self.ITEMS, list(self.coll.items()))
+
     def test_delete(self):
         self.insert_items()
         self.coll.strategy.batch(max_recs=len(self.ITEMS))
         # Should now contain metadata + 1 batch
         assert len(self.e.items) == (self.old_len + 1)
-        # Deletion should trigger split of batch.
+        # Deletion should rewrite the batch.
         self.coll.delete(3)
-        # Should now contain metadata + 2 remaining records.
-        assert len(self.e.items) == (self.old_len + 2)
+        # Should now contain metadata + 1 batch of the remaining records.
+        assert len(self.e.items) == (self.old_len + 1)
         # Values shouldn't have changed.
         assert list(self.coll.items()) == [self.ITEMS[0], self.ITEMS[2]]
 
     def test_delete_pop(self):
         self.insert_items()
         self.coll.strategy.batch(max_recs=len(self.ITEMS))
-        # Pop should trigger split of batch and return of old value.
+        # Pop should rewrite the batch and return the old value.
         data = self.coll.strategy.pop(self.txn.get(), keylib.Key(3))
         eq(data, '"jim"')
-        # Should now contain metadata + 2 remaining records.
-        assert len(self.e.items) == (self.old_len + 2)
-        # Obj should be old value
+        # Should now contain metadata + 1 batch of the remaining records.
+        assert len(self.e.items) == (self.old_len + 1)
+        # Removing a batch endpoint changes the batch's physical key.
+        self.coll.delete(4)
+        assert len(self.e.items) == (self.old_len + 1)
+        eq([self.ITEMS[0]], list(self.coll.items()))
 
     def test_put(self):
         """Overwrite key existing as part of a batch."""
@@ -356,10 +701,10 @@ class BatchTest:
         self.coll.strategy.batch(max_recs=len(self.ITEMS))
         # Should now contain metadata + 1 batch
         assert len(self.e.items) == (self.old_len + 1)
-        # Put should trigger split of batch and modification of record.
+        # Put should rewrite the batch with the modified record.
         self.coll.put(u'james', key=3)
-        # Should now contain metadata + 3 individual records
-        assert len(self.e.items) == (self.old_len + 3)
+        # Should still contain metadata + 1 batch
+        assert len(self.e.items) == (self.old_len + 1)
         # Test for new items.
         assert list(self.coll.items()) ==\
             [self.ITEMS[0], ((3,), 'james'), self.ITEMS[2]]
@@ -369,14 +714,563 @@ class BatchTest:
         exist."""
         self.insert_items()
         self.coll.strategy.batch(max_recs=len(self.ITEMS))
-        # Put should trigger split of batch and insert of record.
+        # Put should rewrite the batch with the inserted record.
         self.coll.put(u'john', key=2)
-        # Should now contain metadata + 4 individual records
-        assert len(self.e.items) == (self.old_len + 4)
+        # Should still contain metadata + 1 batch
+        assert len(self.e.items) == (self.old_len + 1)
         # Test for new items.
         assert list(self.coll.items()) ==\
             [self.ITEMS[0], ((2,), 'john'), ((3,), 'jim'), self.ITEMS[2]]
 
+    def test_put_grows(self):
+        """Split a batch in two once inserts exceed the batch limits."""
+        self.store.add_collection('grown', max_recs=len(self.ITEMS))
+        # Limits are persisted, rather than taken from the last batch().
+        info = self.store.get_meta(acid.core.KIND_TABLE, 'grown')
+        self.coll = acid.Collection(self.store, info)
+        self.insert_items()
+        self.coll.strategy.batch(max_recs=100)
+        for i in xrange(10, 110):
+            self.coll.put(u'x', key=(3, i))
+        it = self.coll.strategy.iter(self.txn.get())
+        counts = [len(list(grp)) for _, grp in
+                  itertools.groupby(tuple(r.keys) for r in it.forward())]
+        eq(103, sum(counts))
+        testlib.le(max(counts), len(self.ITEMS))
+        testlib.le(2, min(counts))
+        eq(103, len(list(self.coll.items())))
+
+    def test_put_too_large(self):
+        """Split a batch whose rewrite would exceed the format's limits."""
+        self.insert_items()
+        self.coll.strategy.batch(max_recs=len(self.ITEMS))
+        big = u'x' * 70000
+        self.coll.put(big, key=3)
+        # Should now contain metadata + 3 individual records
+        eq(self.old_len + 3, len(self.e.items))
+        eq([self.ITEMS[0], ((3,), big), self.ITEMS[2]],
+           list(self.coll.items()))
+
+
+@testlib.register()
+class BatchV3Test(BatchTest):
+    def setUp(self):
+        self.e = acid.engines.ListEngine()
+        self.store = acid.Store(self.e)
+        self.txn = self.store.begin()
+        self.txn.__enter__()
+        self.coll = self.store.add_collection('people', strategy='batch3')
+
+    def test_batch_max_bytes(self):
+        self.insert_items()
+        # 2 members encode to 65 bytes, 3 members to 84 bytes.
+        self.coll.strategy.batch(max_bytes=70)
+        eq(self.old_len + 2, len(self.e.items))
+        eq(self.ITEMS, list(self.coll.items()))
+
+    def test_put_too_large(self):
+        # Random access batches have no size limit, so are always rewritten.
+        self.insert_items()
+        self.coll.strategy.batch(max_recs=len(self.ITEMS))
+        big = u'x' * 70000
+        self.coll.put(big, key=3)
+        eq(self.old_len + 1, len(self.e.items))
+        eq(big, self.coll.get(3))
+
+    def test_reopen(self):
+        store = acid.Store(self.e)
+        self.assertRaises(acid.errors.ConfigError,
+                          store.add_collection, 'people', strategy='batch')
+        coll = store.add_collection('people')
+        assert isinstance(coll.strategy, acid.core.BatchV3Strategy)
+
+    def test_get_one_block(self):
+        unpacks = []
+        def unpack(data):
+            unpacks.append(1)
+            return str(data)
+        compressor = acid.encoders.Compressor('count', unpack, lambda o: o)
+        coll = acid.Collection(self.store, self.coll.info,
+                               compressor=compressor)
+        coll.strategy.BLOCK_SIZE = 20
+        recs = [u'record %d' % i for i in xrange(50)]
+        keys = coll.put_many(recs)
+        eq((50, 1, (50,)), coll.strategy.batch(max_recs=50))
+        for key, rec in zip(keys, recs):
+            count = len(unpacks)
+            eq(rec, coll.get(key))
+            testlib.le(len(unpacks) - count, 1)
+        # 2 records per block, each block decompressed once.
+        eq(25, len(unpacks))
+        eq(None, coll.get(51))
+        eq(recs, list(coll.values()))
+
+
+@testlib.register()
+class ColumnarTest:
+    CITIES = [u'London', u'Paris', u'Berlin']
+
+    def setUp(self):
+        self.st = acid.structlib.StructType()
+        self.st.add_field('id', 1, 'varint', False)
+        self.st.add_field('name', 2, 'text', False)
+        self.st.add_field('city', 3, 'text', False)
+        self.st.add_field('score', 4, 'double', False)
+        self.st.add_field('tags', 5, 'text', True)
+        self.st.add_field('big', 6, 'u64', False)
+        self.encoder = acid.encoders.make_struct_encoder(self.st)
+        self.store = acid.Store(acid.engines.ListEngine())
+        self.txn = self.store.begin(write=True)
+        self.txn.__enter__()
+        self.coll = self.store.add_collection('people', strategy='columnar',
+                                              encoder=self.encoder,
+                                              compressor=acid.encoders.ZLIB)
+
+    def tearDown(self):
+        self.txn.__exit__(None, None, None)
+
+    def make(self, i):
+        rec = self.st.new()
+        rec.id = (i * 3) - 20
+        rec.name = u'user%d' % i
+        rec.city = self.CITIES[i % 3]
+        if i % 4:
+            rec.score = i / 2.0
+        rec.tags = [u't%d' % i, u'z']
+        rec.big = (2 ** 64) - 1 - i
+        return rec
+
+    def insert(self, n=50):
+        self.coll.put_many([self.make(i) for i in xrange(n)])
+
+    def project(self, fields):
+        # Sequences are returned as lazy views.
+        return [(key, tuple(list(v) if hasattr(v, '__iter__') else v
+                            for v in values))
+                for key, values in self.coll.project(fields)]
+
+    def test_roundtrip(self):
+        self.insert()
+        before = list(self.coll.items(raw=True))
+        eq((50, 3, (50,)), self.coll.strategy.batch(max_recs=20))
+        eq(before, list(self.coll.items(raw=True)))
+        rec = self.coll.get(5)
+        eq(u'user4', rec.name)
+        eq((2 ** 64) - 5, rec.big)
+
+    def test_update(self):
+        self.insert()
+        self.coll.strategy.batch(max_recs=50)
+        rec = self.coll.get(5)
+        rec.name = u'changed'
+        self.coll.put(rec, key=5)
+        self.coll.delete(7)
+        eq(u'changed', self.coll.get(5).name)
+        eq(u'user5', self.coll.get(6).name)
+        eq(None, self.coll.get(7))
+        eq(49, len(list(self.coll.keys())))
+
+    def test_unknown_fields(self):
+        # Fields unknown to the collection's type survive a batch.
+        wide = acid.structlib.StructType()
+        for field in self.st.sorted_by_id:
+            wide.add_field(field.name, field.field_id, field.KIND,
+                           field.sequence)
+        wide.add_field('extra', 9, 'text', False)
+        wcoll = acid.Collection(self.store, self.coll.info,
+                                encoder=acid.encoders.make_struct_encoder(wide),
+                                compressor=acid.encoders.ZLIB)
+        rec = wide.new()
+        rec.id = 1
+        rec.extra = u'kept'
+        wcoll.put(rec, key=1)
+        wcoll.put(rec, key=2)
+        self.coll.strategy.batch(max_recs=2)
+        eq(u'kept', wcoll.get(1).extra)
+        eq([((1,), (u'kept',)), ((2,), (u'kept',))],
+           list(wcoll.project(['extra'])))
+
+    def test_project(self):
+        self.insert()
+        fields = ['id', 'city', 'tags', 'score']
+        before = self.project(fields)
+        eq(((-17, u'Paris', [u't1', u'z'], 0.5)), before[1][1])
+        self.coll.strategy.batch(max_recs=20)
+        eq(before, self.project(fields))
+        self.assertRaises(ValueError, self.coll.project, ['missing'])
+
+    def test_project_decodes_columns(self):
+        self.insert()
+        self.coll.strategy.batch(max_recs=50)
+        reads = []
+        field = self.st.field_id_map[3]
+        read = field.read
+        field.read = lambda buf, pos: (reads.append(1), read(buf, pos))[1]
+        try:
+            cities = [values[0] for _, values in self.coll.project(['city'])]
+        finally:
+            del field.read
+        eq([self.CITIES[i % 3] for i in xrange(50)], cities)
+        # Dictionary coded, so each distinct city is decoded once.
+        eq(3, len(reads))
+
+    def test_project_struct(self):
+        coll = self.store.add_collection('plain', encoder=self.encoder)
+        coll.put_many([self.make(i) for i in xrange(2)])
+        eq([((1,), (-20, u'London', None)), ((2,), (-17, u'Paris', 0.5))],
+           list(coll.project(['id', 'city', 'score'])))
+        self.assertRaises(ValueError, coll.project, ['missing'])
+
+    def test_max_bytes_plain(self):
+        # Uncompressed batches are not encoded after every append.
+        coll = self.store.add_collection('plain', strategy='columnar',
+                                         encoder=self.encoder)
+        coll.put_many([self.make(i) for i in xrange(200)])
+        before = list(coll.items(raw=True))
+        calls = []
+        pack_columns = acid.structlib.pack_columns
+        def counting(*args):
+            calls.append(1)
+            return pack_columns(*args)
+        acid.structlib.pack_columns = counting
+        try:
+            found, made, _ = coll.strategy.batch(max_bytes=1000)
+        finally:
+            acid.structlib.pack_columns = pack_columns
+        eq(200, found)
+        # Previously encoded once per record.
+        lt(len(calls), found // 4)
+        eq(before, list(coll.items(raw=True)))
+        prefix = coll.strategy.prefix
+        for key, data in self.store.engine.items:
+            if key.startswith(prefix):
+                testlib.le(len(data), 1000)
+
+    def test_project_basic(self):
+        coll = self.store.add_collection('json')
+        coll.put_many([{u'a': 1, u'b': 2}, {u'a': 3}])
+        eq([((1,), (1, 2)), ((2,), (3, None))], list(coll.project('ab')))
+
+    def test_requires_struct_encoder(self):
+        self.assertRaises(acid.errors.ConfigError,
+                          self.store.add_collection, 'bad',
+                          strategy='columnar')
+        # No metadata was saved for the rejected collection.
+        eq({}, self.store.get_meta(acid.core.KIND_TABLE, 'bad'))
+
+
+@testlib.register()
+class BatchCacheTest:
+    def setUp(self):
+        self.store = acid.Store(acid.engines.ListEngine())
+        with self.store.begin(write=True):
+            info = self.store.add_collection('stuff').info
+            self.coll = acid.Collection(self.store, info,
+                                        compressor=acid.encoders.ZLIB)
+            self.keys = self.coll.put_many(range(10))
+            self.coll.strategy.batch(max_recs=10)
+
+    def test_get(self):
+        with self.store.begin():
+            for i, key in enumerate(self.keys):
+                eq(i, self.coll.get(key))
+            eq({'hits': 9, 'misses': 1, 'size': 1},
+               self.store.batch_cache_stats())
+        eq(0, self.store.batch_cache_stats()['size'])
+
+    def test_rewrite(self):
+        with self.store.begin(write=True):
+            eq(0, self.coll.get(self.keys[0]))
+            self.coll.put(99, key=self.keys[5])
+            # Rebuilding the batch reuses its physical key.
+            self.coll.strategy.batch(max_recs=10)
+            eq(99, self.coll.get(self.keys[5]))
+            eq([0, 1, 2, 3, 4, 99, 6, 7, 8, 9], list(self.coll.values()))
+
+    def test_disabled(self):
+        store = acid.Store(self.store.engine, batch_cache_size=0)
+        coll = acid.Collection(store, self.coll.info,
+                               compressor=acid.encoders.ZLIB)
+        with store.begin():
+            eq(range(10), list(coll.values()))
+        eq({'hits': 0, 'misses': 0, 'size': 0}, store.batch_cache_stats())
+
+
+@testlib.register()
+class BufferUnpackTest:
+    def make(self, accept):
+        seen = []
+        def loads(data):
+            seen.append(type(data))
+            if not (accept or isinstance(data, str)):
+                raise TypeError('buffer unsupported')
+            return str(data)
+        unpack = acid.encoders._buffer_unpack(loads, 'probe')
+        del seen[:]
+        eq('abc', unpack(None, buffer('abc')))
+        return seen
+
+    def test_direct(self):
+        eq([buffer], self.make(True))
+
+    def test_copy(self):
+        eq([str], self.make(False))
+
+    def test_json(self):
+        eq({u'a': [1]}, acid.encoders.JSON.unpack(None, buffer('{"a":[1]}')))
+
+
+@testlib.register()
+class CompressorTest:
+    def setUp(self):
+        self.CASES = ['', 'a', 'abcd' * 3, 'abcdefgh' * 100, 'a' * 70000,
+                      ''.join(chr(i % 251) for i in xrange(3000)),
+                      ''.join('{"id":%d,"name":"user%d"}' % (i, i)
+                              for i in xrange(300))]
+        self.COMPRESSORS = [acid.encoders.LZ4, acid.encoders.SNAPPY]
+
+    def test_roundtrip(self):
+        for comp in self.COMPRESSORS:
+            for data in self.CASES:
+                packed = comp.pack(data)
+                eq(data, comp.unpack(buffer(packed)), comp)
+            testlib.le(len(comp.pack(self.CASES[-1])), len(self.CASES[-1]) / 2)
+
+    def test_corrupt(self):
+        for comp in self.COMPRESSORS:
+            packed = comp.pack(self.CASES[3])
+            for bad in packed[:-1], chr(ord(packed[0]) ^ 1) + packed[1:]:
+                self.assertRaises(ValueError, comp.unpack, bad)
+            # Sizes the input could not produce are rejected before
+            # allocating the output.
+            self.assertRaises(ValueError, comp.unpack,
+                              '\xff\xff\xff\xff\x0f' + packed[-10:])
+
+    def test_collection(self):
+        store = acid.Store(acid.engines.ListEngine())
+        for comp in self.COMPRESSORS:
+            with store.begin(write=True):
+                info = store.add_collection(comp.name).info
+                coll = acid.Collection(store, info, compressor=comp)
+                coll.put_many(range(100))
+                coll.strategy.batch(max_recs=20)
+                eq(range(100), list(coll.values()))
+
+
+@testlib.register()
+class DictCompressorTest:
+    def setUp(self):
+        self.e = acid.engines.ListEngine()
+        self.store = acid.Store(self.e)
+        self.comp = acid.encoders.DictCompressor('people_dict')
+        with self.store.begin(write=True):
+            info = self.store.add_collection('people').info
+            self.coll = acid.Collection(self.store, info, compressor=self.comp)
+            self.recs = [{u'name': u'user%d' % i, u'city': u'London',
+                          u'email': u'user%d@example.com' % i}
+                         for i in xrange(100)]
+            self.keys = self.coll.put_many(self.recs)
+
+    def test_no_dict(self):
+        data = 'hello hello hello'
+        packed = self.comp.pack(data)
+        eq('\x00', packed[0])
+        eq(data, self.comp.unpack(buffer(packed)))
+
+    def test_train(self):
+        eq(1, self.store.train_compressor(self.comp, self.coll))
+        sample = ''.join(self.coll.encoder.pack(r) for r in self.recs[:5])
+        lt(len(self.comp.pack(sample)), len(zlib.compress(sample)))
+
+        with self.store.begin(write=True):
+            self.coll.strategy.batch(max_recs=10)
+            eq(self.recs, list(self.coll.values()))
+
+        # Dictionaries are reloaded when registering a new instance.
+        store = acid.Store(self.e)
+        comp = acid.encoders.DictCompressor('people_dict')
+        coll = acid.Collection(store, self.coll.info, compressor=comp)
+        with store.begin(write=True):
+            store.add_encoder(comp)
+            eq(1, comp.version)
+            eq(self.recs, list(coll.values()))
+
+    def test_retrain(self):
+        self.store.train_compressor(self.comp, self.coll)
+        with self.store.begin(write=True):
+            self.coll.strategy.batch(max_recs=10)
+        eq(2, self.store.train_compressor(self.comp, self.coll))
+        with self.store.begin(write=True):
+            self.coll.put({u'name': u'new'}, key=self.keys[0])
+            self.coll.strategy.batch(max_recs=10)
+            eq(self.recs[1:], list(self.coll.values())[1:])
+
+        comp = acid.encoders.DictCompressor('people_dict')
+        self.assertRaises(acid.errors.ConfigError, comp.unpack,
+                          self.comp.pack('x'))
+
+    def test_retrain_elsewhere(self):
+        # A second process sees batches using a dictionary trained after it
+        # registered the compressor.
+        store = acid.Store(self.e)
+        comp = acid.encoders.DictCompressor('people_dict')
+        coll = acid.Collection(store, self.coll.info, compressor=comp)
+        with store.begin(write=True):
+            store.add_encoder(comp)
+            eq(self.recs, list(coll.values()))
+        eq(1, self.store.train_compressor(self.comp, self.coll))
+        with self.store.begin(write=True):
+            self.coll.strategy.batch(max_recs=10)
+        with store.begin():
+            eq(self.recs, list(coll.values()))
+        eq(1, comp.version)
+
+    def test_train_batched(self):
+        # Batches written by another compressor are sampled using it, and
+        # without holding a write transaction.
+        modes = []
+        def unpack(data):
+            modes.append(self.store._txn_context.mode())
+            return zlib.decompress(data)
+        comp = acid.encoders.Compressor('zlib', unpack, zlib.compress)
+        with self.store.begin(write=True):
+            self.store.add_encoder(comp)
+            coll = acid.Collection(self.store, self.coll.info, compressor=comp)
+            coll.strategy.batch(max_recs=20)
+        eq(1, self.store.train_compressor(self.comp, coll))
+        assert modes and not any(modes)
+        with self.store.begin():
+            eq(self.recs, list(coll.values()))
+
+    def test_train_tool(self):
+        import acid.tool
+        with self.store.begin(write=True):
+            coll = acid.Collection(self.store, self.coll.info,
+                                   compressor=acid.encoders.ZLIB)
+            coll.strategy.batch(max_recs=20)
+
+        class opts:
+            coll = 'people'
+            compressor = 'zlib'
+        acid.tool.STORE = self.store
+        try:
+            acid.tool.cmd_train(opts, [])
+        finally:
+            acid.tool.STORE = None
+        with self.store.begin():
+            eq(1, self.store.get_meta(acid.core.KIND_ENCODER,
+                                      'people_dict')['dict_version'])
+            eq(self.recs, list(coll.values()))
+
+
+@testlib.register()
+class CompactorTest:
+    def setUp(self):
+        self.e = acid.engines.ListEngine()
+        self.store = acid.Store(self.e)
+        with self.store.begin(write=True):
+            self.coll = self.store.add_collection('stuff')
+        self.compactor = acid.core.Compactor(self.store, max_phys=20)
+        self.compactor.watch(self.coll, max_recs=10)
+
+    def put_range(self, start, stop):
+        with self.store.begin(write=True):
+            recs = range(start, stop)
+            self.coll.put_many(recs, keys=recs)
+
+    def run_all(self):
+        while self.compactor.run_once():
+            pass
+
+    def test_compact(self):
+        self.put_range(0, 45)
+        self.put_range(45, 95)
+        eq(2, self.compactor.stats()['pending'])
+        old_len = len(self.e.items)
+        self.run_all()
+        stats = self.compactor.stats()
+        eq((95, 0), (stats['found'], stats['pending']))
+        # Each transaction visits at most 20 records.
+        testlib.le(5, stats['passes'])
+        eq(old_len - 95 + stats['made'], len(self.e.items))
+        with self.store.begin():
+            eq(range(95), list(self.coll.values()))
+
+    def test_disjoint(self):
+        self.put_range(0, 5)
+        with self.store.begin(write=True):
+            self.coll.put(100, key=100)
+        self.put_range(2, 8)
+        eq(2, self.compactor.stats()['pending'])
+        self.run_all()
+        eq(9, self.compactor.stats()['found'])
+
+    def test_abort(self):
+        with self.store.begin(write=True):
+            self.coll.put(1)
+            acid.abort()
+        eq(0, self.compactor.stats()['pending'])
+
+    def test_min_age(self):
+        self.compactor.min_age = 3600
+        self.put_range(0, 10)
+        eq(False, self.compactor.run_once())
+        eq(1, self.compactor.stats()['pending'])
+
+    def test_thread(self):
+        self.compactor.interval = 0.01
+        self.compactor.start()
+        try:
+            self.put_range(0, 50)
+            for _ in xrange(500):
+                if self.compactor.stats()['found'] == 50:
+                    break
+                time.sleep(0.01)
+        finally:
+            self.compactor.stop()
+        eq(50, self.compactor.stats()['found'])
+
+    def test_grouper(self):
+        self.put_range(0, 20)
+        with self.store.begin(write=True):
+            found, made, _ = self.coll.batch(max_recs=10,
+                                             grouper=lambda rec: rec // 5)
+        eq((20, 4), (found, made))
+        with self.store.begin():
+            eq(range(20), list(self.coll.values()))
+
+
+@testlib.register()
+class BatchMaxBytesTest:
+    def setUp(self):
+        self.packs = 0
+        def pack(data):
+            self.packs += 1
+            return zlib.compress(data)
+        zlib_ = acid.encoders.ZLIB
+        self.compressor = acid.encoders.Compressor('zlib', zlib_.unpack,
+                                                   pack, zlib_.stream)
+        self.e = acid.engines.ListEngine()
+        self.store = acid.Store(self.e)
+        self.txn = self.store.begin(write=True)
+        self.txn.__enter__()
+        self.coll = self.store.add_collection('stuff',
+                                              compressor=self.compressor)
+        self.recs = [u'record %d %s' % (i, u'x' * (i % 37))
+                     for i in xrange(500)]
+        for rec in self.recs:
+            self.coll.put(rec)
+
+    def test_max_bytes(self):
+        found, made, _ = self.coll.strategy.batch(max_bytes=1000)
+        eq(500, found)
+        for key, value in self.e.items:
+            assert len(value) <= 1000
+        eq(self.recs, list(self.coll.values()))
+        # Exact compression happens near the limit only, rather than
+        # following every append.
+        assert self.packs < (found / 4), self.packs
+
 
 @testlib.register()
 class CountTest:
@@ -410,6 +1304,157 @@ class CountTest:
         eq(self.e.put_count, 3)
 
 
+@testlib.register()
+class LeaseTest:
+    def setUp(self):
+        self.e = testlib.CountingEngine(acid.engines.ListEngine())
+        self.store = acid.Store(self.e)
+
+    def test_block(self):
+        with self.store.begin(write=True):
+            eq(range(1, 26), [self.store.lease('test', 10)
+                              for _ in xrange(25)])
+            eq(3, self.e.put_count)
+            eq(31, self.store.count('test', n=0))
+
+    def test_high_water(self):
+        with self.store.begin(write=True):
+            eq(1, self.store.lease('test', 10))
+        # Another process continues from the high-water mark.
+        store2 = acid.Store(self.e)
+        with store2.begin(write=True):
+            eq(11, store2.lease('test', 10))
+        with self.store.begin(write=True):
+            eq(2, self.store.lease('test', 10))
+
+    def test_abort_discards(self):
+        # In-memory engines lack rollback, so observe the range being
+        # re-reserved rather than the counter rewinding.
+        with self.store.begin(write=True):
+            eq(1, self.store.lease('test', 10))
+            acid.abort()
+        old = self.e.put_count
+        with self.store.begin(write=True):
+            eq(11, self.store.lease('test', 10))
+            eq(12, self.store.lease('test', 10))
+        eq(old + 1, self.e.put_count)
+        with self.store.begin(write=True):
+            eq(13, self.store.lease('test', 10))
+            acid.abort()
+        # Committed range survives abort of a later transaction.
+        old = self.e.put_count
+        with self.store.begin(write=True):
+            eq(14, self.store.lease('test', 10))
+        eq(old, self.e.put_count)
+
+    def test_read_abort(self):
+        # Aborting a read transaction leaves another thread's range intact.
+        leased = threading.Event()
+        aborted = threading.Event()
+        def writer():
+            with self.store.begin(write=True):
+                eq(1, self.store.lease('test', 10))
+                leased.set()
+                aborted.wait()
+        thread = threading.Thread(target=writer)
+        thread.start()
+        leased.wait()
+        with self.store.begin():
+            acid.abort()
+        aborted.set()
+        thread.join()
+        old = self.e.put_count
+        with self.store.begin(write=True):
+            eq(2, self.store.lease('test', 10))
+        eq(old, self.e.put_count)
+
+    def test_abort_listeners(self):
+        commits = len(self.store._after_commit)
+        aborts = len(self.store._after_abort)
+        for _ in xrange(5):
+            with self.store.begin(write=True):
+                self.store.lease('test', 10)
+                acid.abort()
+        eq(commits, len(self.store._after_commit))
+        eq(aborts, len(self.store._after_abort))
+
+    def test_collection(self):
+        with self.store.begin(write=True):
+            coll = self.store.add_collection('stuff', counter_block=100)
+            old = self.e.put_count
+            keys = [coll.put(u'x') for _ in xrange(10)]
+            eq([(i,) for i in xrange(1, 11)], keys)
+            # 10 records + 1 counter update.
+            eq(old + 11, self.e.put_count)
+
+
+@testlib.register()
+class MetaCacheTest:
+    def setUp(self):
+        self.e = testlib.CountingEngine(acid.engines.ListEngine())
+        self.store = acid.Store(self.e)
+        with self.store.begin(write=True):
+            for i in xrange(20):
+                self.store.add_collection('coll%d' % i)
+
+    def test_single_scan(self):
+        store = acid.Store(self.e)
+        old = self.e.iter_count
+        with store.begin():
+            for i in xrange(20):
+                store['coll%d' % i]
+                store.get_meta(acid.core.KIND_TABLE, 'coll%d' % i)
+        # Exactly the two scans either side of the counters.
+        eq(old + 2, self.e.iter_count)
+        old = self.e.iter_count
+        with store.begin():
+            store.get_meta(acid.core.KIND_TABLE, 'coll0')
+        eq(old, self.e.iter_count)
+
+    def test_invalidation(self):
+        store2 = acid.Store(self.e)
+        with self.store.begin():
+            assert not self.store.get_meta(acid.core.KIND_TABLE, 'new')
+        with store2.begin(write=True):
+            store2.add_collection('new')
+        with self.store.begin():
+            eq('new', self.store['new'].info['name'])
+
+    def test_own_writes(self):
+        with self.store.begin(write=True):
+            self.store.add_collection('new')
+            eq('new', self.store.get_meta(acid.core.KIND_TABLE,
+                                          'new')['name'])
+        # Merged on commit, so no reload is necessary.
+        old = self.e.iter_count
+        with self.store.begin():
+            eq('new', self.store.get_meta(acid.core.KIND_TABLE,
+                                          'new')['name'])
+        eq(old, self.e.iter_count)
+
+    def test_own_writes_many(self):
+        # Several updates in one transaction are still merged.
+        with self.store.begin(write=True):
+            self.store.add_collection('new1')
+            self.store.add_collection('new2')
+        old = self.e.iter_count
+        with self.store.begin():
+            for name in 'new1', 'new2', 'coll0':
+                eq(name, self.store.get_meta(acid.core.KIND_TABLE,
+                                             name)['name'])
+        eq(old, self.e.iter_count)
+        # Unless another store updated the counter meanwhile.
+        store2 = acid.Store(self.e)
+        with store2.begin(write=True):
+            store2.add_collection('other')
+        with self.store.begin(write=True):
+            self.store.add_collection('new3')
+            self.store.add_collection('new4')
+        with self.store.begin():
+            eq('other', self.store.get_meta(acid.core.KIND_TABLE,
+                                            'other')['name'])
+
+
 @testlib.register()
 class ReopenBugTest:
     """Ensure store metadata survives a round-trip."""
@@ -422,6 +1467,62 @@ class ReopenBugTest:
         st2[u'dave']
 
 
+@testlib.register()
+class PutManyTest:
+    def setUp(self):
+        self.e = acid.engines.ListEngine()
+        self.store = acid.Store(self.e)
+        self.txn = self.store.begin(write=True)
+        self.txn.__enter__()
+        self.coll = self.store.add_collection('stuff')
+        self.idx = acid.add_index(self.coll, 'idx', lambda rec: rec)
+        self.puts = []
+        real_put = self.e.put
+        def put(key, value):
+            self.puts.append(key)
+            real_put(key, value)
+        self.e.put = put
+
+    def test_put_many(self):
+        keys = self.coll.put_many([u'c', u'a', u'b'], keys=[3, 1, 2])
+        eq([(3,), (1,), (2,)], keys)
+        eq([((1,), u'a'), ((2,), u'b'), ((3,), u'c')],
+           list(self.coll.items()))
+        eq([[(u'a',), (1,)], [(u'b',), (2,)], [(u'c',), (3,)]],
+           list(self.idx.pairs()))
+        # Records then index entries, each in key order.
+        eq(sorted(self.puts[:3]), self.puts[:3])
+        eq(sorted(self.puts[3:]), self.puts[3:])
+        assert self.puts[2] < self.puts[3]
+
+    def test_on_update(self):
+        # Listeners run for every record before any is written.
+        seen = []
+        def on_update(key, rec):
+            seen.append((key, rec, self.coll.get(key)))
+        acid.events.on_update(on_update, self.coll)
+        self.coll.put_many([u'b', u'a'], keys=[2, 1])
+        eq([((2,), u'b', None), ((1,), u'a', None)], seen)
+
+    def test_key_func(self):
+        keys = self.coll.put_many([u'a', u'b'])
+        eq([(1,), (2,)], keys)
+
+    def test_replace(self):
+        self.coll.put_many([u'a', u'b'], keys=[1, 2])
+        self.coll.put_many([u'z', u'b'], keys=[1, 2])
+        eq([[(u'b',), (2,)], [(u'z',), (1,)]], list(self.idx.pairs()))
+
+    def test_delete_many(self):
+        self.coll.put_many([u'a', u'b', u'c'], keys=[1, 2, 3])
+        self.coll.delete_many([3, 1])
+        eq([((2,), u'b')], list(self.coll.items()))
+        eq([[(u'b',), (2,)]], list(self.idx.pairs()))
+
+    def test_mismatch(self):
+        self.assertRaises(ValueError, self.coll.put_many, [u'a'], keys=[])
+
+
 @testlib.register()
 class DeleteBugTest:
     """Ensure delete deletes everything it should when indices are present."""
@@ -458,5 +1559,155 @@ class TransactionAbortTest:
         assert crashy() == 123
 
 
+@testlib.register()
+class GroupCommitTest:
+    def setUp(self):
+        self.store = acid.open('list:/')
+        with self.store.begin(write=True):
+            self.coll = self.store.add_collection('stuff')
+        self.group = acid.core.GroupCommit(self.store)
+        self.commits = []
+        acid.events.after_commit(lambda: self.commits.append(1), self.coll)
+
+    def test_submit(self):
+        key = self.group.submit(lambda: self.coll.put(u'a'))
+        eq(1, len(self.commits))
+        with self.store.begin():
+            eq(u'a', self.coll.get(key))
+
+    def test_abort(self):
+        def aborty():
+            self.coll.put(u'a', key=1)
+            acid.abort()
+        eq(None, self.group.submit(aborty))
+        with self.store.begin():
+            eq(None, self.coll.get(1))
+
+    def test_txn_active(self):
+        with self.store.begin():
+            self.assertRaises(acid.errors.TxnError,
+                              self.group.submit, lambda: None)
+
+    def test_error_isolation(self):
+        go = threading.Event()
+        results = {}
+
+        def slow():
+            go.wait()
+            return self.coll.put(u'slow', key=1)
+
+        def crashy():
+            self.coll.put(u'crashy', key=1)
+            self.coll.put(u'crashy', key=2)
+            raise ValueError('crashy')
+
+        def submit(name, func):
+            try:
+                results[name] = self.group.submit(func)
+            except Exception, e:
+                results[name] = e
+
+        threads = [threading.Thread(target=submit, args=('slow', slow))]
+        threads[0].start()
+        while not self.group._busy:
+            time.sleep(0.001)
+        # Queue up a group behind the leader.
+        for name, func in ('crashy', crashy), \
+                          ('ok', lambda: self.coll.put(u'ok', key=3)):
+            threads.append(threading.Thread(target=submit, args=(name, func)))
+            threads[-1].start()
+        while len(self.group._queue) < 2:
+            time.sleep(0.001)
+        go.set()
+        for thread in threads:
+            thread.join()
+
+        eq((1,), results['slow'])
+        eq((3,), results['ok'])
+        assert isinstance(results['crashy'], ValueError)
+        eq(2, len(self.commits))
+        with self.store.begin():
+            eq([((1,), u'slow'), ((3,), u'ok')], list(self.coll.items()))
+
+    def test_failed_slot_state(self):
+        # A failing closure discards only its own in-memory state.
+        compactor = acid.core.Compactor(self.store)
+        compactor.watch(self.coll, max_recs=10)
+
+        def ok():
+            self.coll.put(u'ok', key=1)
+            self.store.set_meta('test', 'ok', {'v': 1})
+            return self.store.lease('x', 10)
+
+        def crashy():
+            self.coll.put(u'crashy', key=5)
+            self.store.set_meta('test', 'crashy', {'v': 2})
+            self.store.lease('x', 10)
+            self.store.lease('y', 10)
+            raise ValueError('crashy')
+
+        slots = [acid.core._GroupSlot(ok), acid.core._GroupSlot(crashy)]
+        self.group._queue.extend(slots)
+        self.group._busy = True
+        self.group._run_group()
+        eq(1, slots[0].result)
+        assert isinstance(slots[1].exc_info[1], ValueError)
+        eq(1, len(self.commits))
+        eq([(1,)], [rng[0] for rng in compactor._dirty['stuff']])
+        eq(['x'], self.store._leases.keys())
+        assert self.store._leases['x'][2]
+        eq({'v': 1}, self.store._meta_cache[1][('test', 'ok')])
+        assert ('test', 'crashy') not in self.store._meta_cache[1]
+        with self.store.begin():
+            eq([(1,)], list(self.coll.keys()))
+            eq({}, self.store.get_meta('test', 'crashy'))
+
+    def test_base_exception(self):
+        def interrupt():
+            raise KeyboardInterrupt
+        slots = [acid.core._GroupSlot(interrupt),
+                 acid.core._GroupSlot(lambda: self.coll.put(u'x', key=1))]
+        self.group._queue.extend(slots)
+        self.group._busy = True
+        self.assertRaises(KeyboardInterrupt, self.group._run_group)
+        # Followers are woken with the error and the group can be reused.
+        for slot in slots:
+            assert slot.done and slot.event.is_set()
+            self.assertRaises(KeyboardInterrupt, slot.finish)
+        eq(False, self.group._busy)
+        eq((2,), self.group.submit(lambda: self.coll.put(u'y', key=2)))
+        with self.store.begin():
+            eq([(2,)], list(self.coll.keys()))
+
+    def test_many_threads(self):
+        started = threading.Event()
+        go = threading.Event()
+
+        def leader():
+            started.set()
+            go.wait()
+            self.coll.put(u'x', key=0)
+
+        threads = [threading.Thread(target=self.group.submit, args=(leader,))]
+        threads[0].start()
+        started.wait()
+        # Hold the writer while followers queue behind the leader.
+        for n in xrange(1, 21):
+            func = lambda n=n: self.coll.put(u'x', key=n)
+            threads.append(threading.Thread(target=self.group.submit,
+                                            args=(func,)))
+            threads[-1].start()
+        while len(self.group._queue) < 20:
+            time.sleep(0.001)
+        go.set()
+        for thread in threads:
+            thread.join()
+
+        # One commit for the leader, one for the 20 queued closures.
+        eq(2, len(self.commits))
+        with self.store.begin():
+            eq([(n,) for n in xrange(21)], list(self.coll.keys()))
+
+
 if __name__ == '__main__':
     testlib.main()
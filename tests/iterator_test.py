@@ -379,6 +379,82 @@ class BatchIteratorTest:
         eq(BPKEYS[2:5], keyfrom(self.rit.forward))
 
 
+@testlib.register()
+class BatchV2BuilderTest:
+    def setUp(self):
+        self.ITEMS = [
+            (acid.keylib.Key(u'people', 1), 'dave'),
+            (acid.keylib.Key(u'people', 2), 'jim'),
+            (acid.keylib.Key(u'people', 30), 'zork')
+        ]
+        self.b = acid.iterators.BatchV2Builder()
+        for key, value in self.ITEMS:
+            self.b.append(key, value)
+
+    def iter_batch(self, data):
+        engine = acid.engines.ListEngine()
+        keys = self.b.keys()
+        engine.put(acid.keylib.packs([keys[-1], keys[0]], PREFIX), data)
+        it = acid.iterators.BatchV2Iterator(engine, PREFIX,
+                                            acid.encoders.PLAIN)
+        return [(r.key, str(r.data)) for r in it.forward()]
+
+    def test_build(self):
+        eq(self.ITEMS, self.iter_batch(self.b.build()))
+        eq(len(self.b.build()), self.b.size())
+
+    def test_pop(self):
+        self.b.append(acid.keylib.Key(u'zzz'), 'x' * 100)
+        self.b.pop()
+        eq(3, len(self.b))
+        eq(self.ITEMS, self.iter_batch(self.b.build()))
+        eq(len(self.b.build()), self.b.size())
+
+    def test_single(self):
+        self.b.clear()
+        eq(0, self.b.size())
+        self.b.append(self.ITEMS[0][0], buffer('dave'))
+        eq('dave', self.b.build())
+        eq(4, self.b.size())
+        eq([self.ITEMS[0][0]], self.b.keys())
+
+    def test_too_large(self):
+        self.b.append(acid.keylib.Key(u'zzz'), 'x' * 0x10000)
+        self.assertRaises(ValueError, self.b.build)
+
+
+
+@testlib.register()
+class BatchV3BuilderTest:
+    def setUp(self):
+        self.b = acid.iterators.BatchV3Builder(acid.encoders.ZLIB, 16)
+        self.ITEMS = [(acid.keylib.Key(u'people', i), 'value %d' % i)
+                      for i in xrange(20)]
+        for key, value in self.ITEMS:
+            self.b.append(key, value)
+
+    def iter_batch(self, data, reverse=False):
+        engine = acid.engines.ListEngine()
+        keys = self.b.keys()
+        engine.put(acid.keylib.packs([keys[-1], keys[0]], PREFIX), data)
+        it = acid.iterators.BatchV3Iterator(engine, PREFIX,
+                                            acid.encoders.ZLIB)
+        it = it.reverse() if reverse else it.forward()
+        return [(r.key, str(r.data)) for r in it]
+
+    def test_build(self):
+        data = self.b.build()
+        eq(len(data), self.b.size())
+        eq(self.ITEMS, self.iter_batch(data))
+        eq(self.ITEMS[::-1], self.iter_batch(data, reverse=True))
+
+    def test_pop(self):
+        # Popping across a block boundary reopens the previous block.
+        for _ in xrange(5):
+            self.b.pop()
+        data = self.b.build()
+        eq(len(data), self.b.size())
+        eq(self.ITEMS[:15], self.iter_batch(data))
 
 if __name__ == '__main__':
     testlib.main()
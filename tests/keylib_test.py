@@ -72,6 +72,25 @@ class KeysTest:
 
 
 
+@testlib.register()
+class SortedDiffTest:
+    def test_diff(self):
+        eq(([], []), keylib.sorted_diff([], []))
+        eq((['a', 'c'], []), keylib.sorted_diff(['a', 'c'], []))
+        eq(([], ['a', 'c']), keylib.sorted_diff([], ['a', 'c']))
+        eq((['a', 'd'], ['b', 'e']),
+           keylib.sorted_diff(['a', 'c', 'd'], ['b', 'c', 'e']))
+
+    def test_prefix(self):
+        # Shorter strings sort first.
+        eq((['ab'], ['a', 'abc']),
+           keylib.sorted_diff(['ab', 'b'], ['a', 'abc', 'b']))
+
+    def test_duplicates(self):
+        eq((['a'], ['d']),
+           keylib.sorted_diff(['a', 'a', 'b', 'b'], ['b', 'd', 'd']))
+
+
 @testlib.register()
 class StringEncodingTest:
     def do_test(self, k):
@@ -0,0 +1,171 @@
+#
+# Copyright 2013, David Wilson.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#    http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+
+"""
+Struct encoding tests.
+"""
+
+import uuid
+
+from acid import structlib
+
+import testlib
+from testlib import eq
+
+
+def make_type():
+    st = structlib.StructType()
+    st.add_field('varint', 1, 'varint', False)
+    st.add_field('uvarint', 2, 'uvarint', False)
+    st.add_field('svarint', 3, 'svarint', False)
+    st.add_field('bool', 4, 'bool', False)
+    st.add_field('double', 5, 'double', False)
+    st.add_field('float', 6, 'float', False)
+    st.add_field('i32', 7, 'i32', False)
+    st.add_field('i64', 8, 'i64', False)
+    st.add_field('u32', 9, 'u32', False)
+    st.add_field('u64', 10, 'u64', False)
+    st.add_field('blob', 11, 'blob', False)
+    st.add_field('text', 12, 'text', False)
+    st.add_field('uuid', 13, 'uuid', False)
+    st.add_field('texts', 14, 'text', True)
+    st.add_field('varints', 15, 'varint', True)
+    return st
+
+
+VALUES = {
+    'varint': -1,
+    'uvarint': 2**64 - 1,
+    'svarint': -300,
+    'bool': True,
+    'double': 1.5,
+    'float': 0.25,
+    'i32': -2**31,
+    'i64': 2**62,
+    'u32': 2**32 - 1,
+    'u64': 2**64 - 1,
+    'blob': 'a\x00b',
+    'text': u'\N{SNOWMAN}',
+    'uuid': uuid.UUID(int=1),
+    'texts': [u'a', u'bc'],
+    'varints': [1, 300, 70000],
+}
+
+# Encoding of VALUES; must not differ between implementations.
+ENCODED = (
+    '\x08\xff\xff\xff\xff\xff\xff\xff\xff\xff\x01'
+    '\x10\xff\xff\xff\xff\xff\xff\xff\xff\xff\x01'
+    '\x18\xd7\x04'
+    '\x20\x01'
+    '\x29\x00\x00\x00\x00\x00\x00\xf8\x3f'
+    '\x35\x00\x00\x80\x3e'
+    '\x3d\x00\x00\x00\x80'
+    '\x41\x00\x00\x00\x00\x00\x00\x00\x40'
+    '\x4d\xff\xff\xff\xff'
+    '\x51\xff\xff\xff\xff\xff\xff\xff\xff'
+    '\x5a\x03a\x00b'
+    '\x62\x03\xe2\x98\x83'
+    '\x6a\x10' + ('\x00' * 15) + '\x01'
+    '\x72\x01a\x72\x02bc'
+    '\x7a\x06\x01\xac\x02\xf0\xa2\x04'
+)
+
+
+@testlib.register()
+class StructTest:
+    def setUp(self):
+        self.st = make_type()
+
+    def make(self):
+        rec = self.st.new()
+        for name, value in VALUES.iteritems():
+            setattr(rec, name, value)
+        return rec
+
+    def test_encode(self):
+        eq(ENCODED, self.st.to_raw(self.make()))
+
+    def test_decode(self):
+        rec = self.st.from_raw(ENCODED)
+        for name, value in VALUES.iteritems():
+            eq(value, list(getattr(rec, name)) if name in ('texts',)
+                      else getattr(rec, name), name)
+        eq(sorted(VALUES), sorted(k for k, _ in self.st.iter_raw(ENCODED)))
+
+    def test_missing(self):
+        rec = self.st.new()
+        rec.text = u'x'
+        raw = self.st.to_raw(rec)
+        eq('\x62\x01x', raw)
+        rec = self.st.from_raw(raw)
+        eq(None, rec.varint)
+        eq(u'x', rec.text)
+
+    def test_skip_unknown(self):
+        st = structlib.StructType()
+        st.add_field('text', 12, 'text', False)
+        st.add_field('varints', 15, 'varint', True)
+        rec = st.from_raw(ENCODED)
+        eq(u'\N{SNOWMAN}', rec.text)
+        eq([1, 300, 70000], rec.varints)
+
+    def test_offsets(self):
+        rec = self.st.from_raw(ENCODED)
+        eq(None, rec._offsets)
+        eq(u'\N{SNOWMAN}', rec.text)
+        # Fields up to and including text, and the resume offset.
+        offsets = rec._offsets
+        eq(13, len(offsets))
+        eq(23, offsets[(3 << 3) | 0])
+        eq(-300, rec.svarint)
+        eq([1, 300, 70000], list(rec.varints))
+        self.assertTrue(offsets is rec._offsets)
+        eq(u'\N{SNOWMAN}', self.st.from_raw(ENCODED).text)
+
+    def test_project(self):
+        text, varint, texts = self.st.project(ENCODED,
+                                              ('text', 'varint', 'texts'))
+        eq((u'\N{SNOWMAN}', -1, [u'a', u'bc']), (text, varint, list(texts)))
+        eq((u'x', None), self.st.project('\x62\x01x', ('text', 'u64')))
+        for names in ('missing',), ('text', 'text'):
+            self.assertRaises(ValueError, self.st.project, ENCODED, names)
+
+    def test_float_range(self):
+        rec = self.st.new()
+        for value in 3.5e38, -1e39:
+            rec.float = value
+            self.assertRaises(OverflowError, self.st.to_raw, rec)
+        rec.float = float('inf')
+        eq(float('inf'), self.st.from_raw(self.st.to_raw(rec)).float)
+
+    def test_varint(self):
+        for i in 0, 1, 127, 128, 16383, 16384, 2**63 - 1, -1, -2**63:
+            out = []
+            structlib.write_varint(out.append, i)
+            s = ''.join(out)
+            eq((len(s), i), structlib.read_varint(s, 0))
+        self.assertRaises(ValueError, structlib.write_varint,
+                          [].append, 2**64)
+
+    def test_svarint(self):
+        rec = self.st.new()
+        for i in 0, 1, -1, 2**62, -2**63:
+            rec.svarint = i
+            eq(i, self.st.from_raw(self.st.to_raw(rec)).svarint)
+
+
+if __name__ == '__main__':
+    testlib.main()